@@ -1,9 +1,15 @@
 #include "basic_sfm.h"
+#include "io_utils.h"
+#include "parallel_utils.h"
 
+#include <algorithm>
 #include <iostream>
-#include <map>
+#include <mutex>
+#include <numeric>
+#include <queue>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 
 #include <ceres/ceres.h>
@@ -94,6 +100,19 @@ namespace
     }
   }
 
+  // Abort the optimization as soon as the flag is set
+  class CancelCallback : public ceres::IterationCallback
+  {
+   public:
+    explicit CancelCallback( const std::atomic<bool> *cancel ) : cancel_(cancel) {};
+    ceres::CallbackReturnType operator()( const ceres::IterationSummary & ) override
+    {
+      return cancel_->load() ? ceres::SOLVER_ABORT : ceres::SOLVER_CONTINUE;
+    }
+   private:
+    const std::atomic<bool> *cancel_;
+  };
+
 } // namespace
 
 BasicSfM::~BasicSfM()
@@ -108,6 +127,10 @@ void BasicSfM::reset()
   observations_.clear();
   colors_.clear();
   parameters_.clear();
+  obs_index_.clear();
+  resetBundleAdjustmentProblem();
+  ba_.cost_functions.clear();
+  ba_.loss.reset();
 
   num_cam_poses_ = num_points_ = num_observations_ = num_parameters_ = 0;
 }
@@ -116,6 +139,12 @@ void BasicSfM::readFromFile ( const std::string& filename, bool load_initial_gue
 {
   reset();
 
+  if( BinaryDataFile::isBinaryDataFile(filename) )
+  {
+    readFromBinaryFile(filename, load_initial_guess, load_colors);
+    return;
+  }
+
   FILE* fptr = fopen(filename.c_str(), "r");
 
   if (fptr == NULL)
@@ -186,6 +215,54 @@ void BasicSfM::readFromFile ( const std::string& filename, bool load_initial_gue
   fclose(fptr);
 }
 
+void BasicSfM::readFromBinaryFile ( const std::string& filename, bool load_initial_guess, bool load_colors )
+{
+  BinaryDataFile data_file;
+  if( !data_file.open(filename) )
+  {
+    cerr << "Error: unable to read file " << filename;
+    return;
+  }
+
+  num_cam_poses_ = data_file.numPoses();
+  num_points_ = data_file.numPoints();
+  num_observations_ = data_file.numObservations();
+
+  cout << "Header: " << num_cam_poses_
+       << " " << num_points_
+       << " " << num_observations_<<std::endl;
+
+  // Arrays are bulk copied from the mapped file, no parsing needed
+  cam_pose_index_.assign(data_file.poseIndex(), data_file.poseIndex() + num_observations_);
+  point_index_.assign(data_file.pointIndex(), data_file.pointIndex() + num_observations_);
+  observations_.assign(data_file.observations(), data_file.observations() + 2*num_observations_);
+
+  num_parameters_ = camera_block_size_ * num_cam_poses_ + point_block_size_ * num_points_;
+  parameters_.assign(num_parameters_, 0);
+
+  if( load_colors )
+  {
+    if( data_file.colors() )
+      colors_.assign(data_file.colors(), data_file.colors() + 3*num_points_);
+    else
+      cerr << "Warning: no colors in file " << filename << endl;
+  }
+
+  if( load_initial_guess && data_file.numParameters() == num_parameters_ )
+  {
+    cam_pose_optim_iter_.resize(num_cam_poses_, 1 );
+    pts_optim_iter_.resize( num_points_, 1 );
+    memcpy(parameters_.data(), data_file.parameters(), num_parameters_*sizeof(double));
+  }
+  else
+  {
+    if( load_initial_guess )
+      cerr << "Warning: no initial guess in file " << filename << endl;
+    // Masks used to indicate which cameras and points have been optimized so far
+    cam_pose_optim_iter_.resize(num_cam_poses_, 0 );
+    pts_optim_iter_.resize( num_points_, 0 );
+  }
+}
 
 void BasicSfM::writeToFile (const string& filename, bool write_unoptimized ) const
 {
@@ -447,108 +524,210 @@ void BasicSfM::printPointParams ( int idx ) const
 
 void BasicSfM::solve()
 {
-  // For each camera pose, prepare a map that reports the pairs [point index, observation index]
-  // This map is used to quickly retrieve the observation index given a 3D point index
+  // Index the observations by camera pose and by 3D point, both sorted: this index is used to quickly retrieve
+  // the observation index given a camera pose and a 3D point index
   // For instance, to query if the camera pose with index i_cam observed the
-  // 3D point with index i_pt, check if cam_observation_[i_cam].find( i_pt ) is not cam_observation_[i_cam].end(), i.e.,:
-  // if(cam_observation_[i_cam].find( i_pt ) != cam_observation_[i_cam].end())  { .... }
-  // In case of success, you can retrieve the observation index obs_id simply with:
-  // obs_id = cam_observation_[i_cam][i_pt]
-  cam_observation_ = vector< map<int,int> > (num_cam_poses_ );
-  for( int i_obs = 0; i_obs < num_observations_; i_obs++ )
+  // 3D point with index i_pt, and in case of success retrieve the observation index obs_id:
+  // int obs_id = obs_index_.findObservation( i_cam, i_pt );
+  // if( obs_id >= 0 ) { .... }
+  // The points observed by the camera pose i_cam are obs_index_.cameraEntries( i_cam ), the camera poses
+  // that observe the point i_pt are obs_index_.pointEntries( i_pt )
+  obs_index_.build( num_cam_poses_, num_points_, cam_pose_index_, point_index_ );
+
+  // Compute the sparse co-visibility graph, i.e., the number of correspondences between the pairs of
+  // camera poses that share at least one point
+  std::vector<ObservationIndex::CoVisibility> co_visibility;
+  obs_index_.coVisibility( co_visibility, num_threads_ );
+
+  // Seed pair candidates, the pair with more correspondences first (the one with smaller indices in case of
+  // ties). Each pair is tested once, unless its evaluation is cancelled (see below)
+  auto worse_pair = []( const ObservationIndex::CoVisibility &p0, const ObservationIndex::CoVisibility &p1 )
   {
-    int i_cam = cam_pose_index_[i_obs], i_pt = point_index_[i_obs];
-    cam_observation_[i_cam][i_pt] = i_obs;
-  }
+    if( p0.num_shared != p1.num_shared )
+      return p0.num_shared < p1.num_shared;
+    return std::make_pair(p0.cam0_idx, p0.cam1_idx) > std::make_pair(p1.cam0_idx, p1.cam1_idx);
+  };
+  std::priority_queue< ObservationIndex::CoVisibility, std::vector<ObservationIndex::CoVisibility>,
+                       decltype(worse_pair) > seed_pairs( worse_pair, std::move(co_visibility) );
 
-  // Compute a (symmetric) num_cam_poses_ X num_cam_poses_ matrix
-  // that counts the number of correspondences between pairs of camera poses
-  Eigen::MatrixXi corr = Eigen::MatrixXi::Zero(num_cam_poses_, num_cam_poses_);
+  // Indices of the two camera poses that define the initial seed pair
+  int seed_pair_idx0, seed_pair_idx1;
 
-  for(int r = 0; r < num_cam_poses_; r++ )
+  // Look for a suitable seed pair....
+  if( num_seed_candidates_ <= 1 )
   {
-    for(int c = r + 1; c < num_cam_poses_; c++ )
+    while( true )
     {
-      int nc = 0;
-      for( auto const& co_iter : cam_observation_[r] )
+      if( seed_pairs.empty() )
+      {
+        std::cout<<"No seed pair found, exiting"<<std::endl;
+        return;
+      }
+      seed_pair_idx0 = seed_pairs.top().cam0_idx;
+      seed_pair_idx1 = seed_pairs.top().cam1_idx;
+      seed_pairs.pop();
+
+      if (incrementalReconstruction( seed_pair_idx0, seed_pair_idx1 ))
+      {
+        std::cout<<"Recostruction completed, exiting"<<std::endl;
+        return;
+      }
+      else
       {
-        if( cam_observation_[c].find(co_iter.first ) != cam_observation_[c].end() )
-          nc++;
+        std::cout<<"Try to look for a better seed pair"<<std::endl;
       }
-      corr(r,c) = nc;
     }
   }
 
-  // num_cam_poses_ X num_cam_poses_ matrix to mask already tested seed pairs
-  // already_tested_pair(r,c) == 0 -> not tested pair
-  // already_tested_pair(r,c) != 0 -> already tested pair
-  Eigen::MatrixXi already_tested_pair = Eigen::MatrixXi::Zero(num_cam_poses_, num_cam_poses_);
-
+  // ... or evaluate several seed pairs at once, and continue the reconstruction from the best ones
+  std::vector< std::unique_ptr<BasicSfM> > workers;
+  while( !seed_pairs.empty() )
+  {
+    std::vector<ObservationIndex::CoVisibility> candidates;
+    while( static_cast<int>(candidates.size()) < num_seed_candidates_ && !seed_pairs.empty() )
+    {
+      candidates.push_back(seed_pairs.top());
+      seed_pairs.pop();
+    }
 
-  // Indices of the two camera poses that define the initial seed pair
-  int seed_pair_idx0, seed_pair_idx1;
+    std::vector<int> scores;
+    evaluateSeedCandidates( candidates, workers, scores );
 
-  // Look for a suitable seed pair....
-  while( true )
-  {
-    int max_corr = -1;
-    for(int r = 0; r < num_cam_poses_; r++ )
+    // The cancelled candidates will be evaluated again, in case the better ones do not lead to a
+    // complete reconstruction
+    std::vector<int> initialized;
+    for( int i = 0; i < static_cast<int>(candidates.size()); i++ )
     {
-      for (int c = r + 1; c < num_cam_poses_; c++)
+      std::cout<<"Seed pair candidate ("<<candidates[i].cam0_idx<<", "<<candidates[i].cam1_idx<<") : ";
+      if( scores[i] == -2 )
       {
-        if( !already_tested_pair(r,c) && corr(r,c) > max_corr )
-        {
-          max_corr = corr(r,c);
-          seed_pair_idx0 = r;
-          seed_pair_idx1 = c;
-        }
+        std::cout<<"cancelled"<<std::endl;
+        seed_pairs.push(candidates[i]);
+      }
+      else if( scores[i] < 0 )
+        std::cout<<"not suitable"<<std::endl;
+      else
+      {
+        std::cout<<scores[i]<<" registered points"<<std::endl;
+        initialized.push_back(i);
       }
     }
+    std::stable_sort( initialized.begin(), initialized.end(), [&scores]( int i0, int i1 )
+                      { return scores[i0] > scores[i1]; } );
 
-    if( max_corr < 0 )
+    for( int i : initialized )
     {
-      std::cout<<"No seed pair found, exiting"<<std::endl;
-      return;
+      std::cout<<"Continue the reconstruction from the seed pair ("
+               <<candidates[i].cam0_idx<<", "<<candidates[i].cam1_idx<<")"<<std::endl;
+      swapReconstructionState( *workers[i] );
+      if( registerCameraPoses() )
+      {
+        std::cout<<"Recostruction completed, exiting"<<std::endl;
+        return;
+      }
+      std::cout<<"Try to look for a better seed pair"<<std::endl;
     }
-    already_tested_pair(seed_pair_idx0, seed_pair_idx1) = 1;
+  }
+  std::cout<<"No seed pair found, exiting"<<std::endl;
+}
 
-    if (incrementalReconstruction( seed_pair_idx0, seed_pair_idx1 ))
-    {
-      std::cout<<"Recostruction completed, exiting"<<std::endl;
-      return;
-    }
-    else
+void BasicSfM::evaluateSeedCandidates( const std::vector<ObservationIndex::CoVisibility> &candidates,
+                                       std::vector< std::unique_ptr<BasicSfM> > &workers,
+                                       std::vector<int> &scores )
+{
+  const int num_candidates = static_cast<int>(candidates.size());
+  while( static_cast<int>(workers.size()) < num_candidates )
+    workers.emplace_back( new BasicSfM(*this) );
+
+  scores.assign(num_candidates, -2);
+  std::vector< std::atomic<bool> > cancel(num_candidates);
+  for( auto &c : cancel )
+    c = false;
+  std::vector<char> done(num_candidates, 0);
+  std::mutex mutex;
+
+  // The threads are shared among the concurrent workers, each one running its bundle adjustments on its
+  // own share
+  const int num_threads = resolveNumThreads(num_threads_);
+  WorkStealingPool pool( std::min(num_candidates, num_threads) );
+  const int worker_ba_threads = std::max( 1, num_threads/pool.numThreads() );
+  for( int i = 0; i < num_candidates; i++ )
+  {
+    pool.submit([&, i]()
     {
-      std::cout<<"Try to look for a better seed pair"<<std::endl;
-    }
+      BasicSfM &worker = *workers[i];
+      worker.ba_num_threads_ = worker_ba_threads;
+      // Workers are reused: each candidate starts from empty masks, not from the ones of a previous candidate
+      worker.cam_pose_optim_iter_.assign(num_cam_poses_, 0);
+      worker.pts_optim_iter_.assign(num_points_, 0);
+      worker.seed_cancel_ = &cancel[i];
+      bool initialized = worker.initializeSeedPair( candidates[i].cam0_idx, candidates[i].cam1_idx );
+      worker.seed_cancel_ = nullptr;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      done[i] = 1;
+      if( cancel[i] )
+        return;
+      if( !initialized )
+      {
+        scores[i] = -1;
+        return;
+      }
+      int score = static_cast<int>( std::count_if( worker.pts_optim_iter_.begin(), worker.pts_optim_iter_.end(),
+                                                   []( int it ){ return it > 0; } ) );
+      scores[i] = score;
+
+      // A candidate can't register more points than its correspondences: cancel the ones that can't beat
+      // this one (the one with more correspondences wins the ties)
+      for( int j = 0; j < num_candidates; j++ )
+      {
+        if( !done[j] && ( candidates[j].num_shared < score || ( candidates[j].num_shared == score && j > i ) ) )
+          cancel[j] = true;
+      }
+    });
   }
+  pool.wait();
+}
+
+void BasicSfM::swapReconstructionState( BasicSfM &other )
+{
+  parameters_.swap(other.parameters_);
+  cam_pose_optim_iter_.swap(other.cam_pose_optim_iter_);
+  pts_optim_iter_.swap(other.pts_optim_iter_);
+  // The problems refer to the swapped parameters: they are built again
+  resetBundleAdjustmentProblem();
+  other.resetBundleAdjustmentProblem();
 }
 
 bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1 )
+{
+  return initializeSeedPair( seed_pair_idx0, seed_pair_idx1 ) && registerCameraPoses();
+}
+
+bool BasicSfM::initializeSeedPair( int seed_pair_idx0, int seed_pair_idx1 )
 {
   // Reset all parameters: we are starting a brand new reconstruction from a new seed pair
   memset(parameters_.data(), 0, num_parameters_*sizeof(double));
   // Masks used to indicate which cameras and points have been optimized so far
   cam_pose_optim_iter_.resize(num_cam_poses_, 0 );
   pts_optim_iter_.resize( num_points_, 0 );
+  resetBundleAdjustmentProblem();
 
+  if( seedCancelled() )
+    return false;
 
   // Init R,t between the seed pair
-  cv::Mat init_r_mat, init_r_vec, init_t_vec;
+  cv::Mat init_r_mat, init_t_vec;
 
   std::vector<cv::Point2d> points0, points1;
   cv::Mat inlier_mask_E, inlier_mask_H;
 
   // Collect matches between the two images of the seed pair, to be used to extract the models E and H
-  for (auto const &co_iter: cam_observation_[seed_pair_idx0])
+  obs_index_.forEachShared( seed_pair_idx0, seed_pair_idx1, [&]( int, int obs0_idx, int obs1_idx )
   {
-    if (cam_observation_[seed_pair_idx1].find(co_iter.first) != cam_observation_[seed_pair_idx1].end())
-    {
-      points0.emplace_back(observations_[2*co_iter.second],observations_[2*co_iter.second + 1]);
-      points1.emplace_back(observations_[2*cam_observation_[seed_pair_idx1][co_iter.first]],
-                           observations_[2*cam_observation_[seed_pair_idx1][co_iter.first] + 1]);
-    }
-  }
+    points0.emplace_back(observations_[2*obs0_idx],observations_[2*obs0_idx + 1]);
+    points1.emplace_back(observations_[2*obs1_idx],observations_[2*obs1_idx + 1]);
+  });
 
   // Canonical camera so identity K
   cv::Mat_<double> intrinsics_matrix = cv::Mat_<double>::eye(3,3);
@@ -611,6 +790,8 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
   }
 
   std::cout << "Found good seed pair with sideward motion." << std::endl;
+  if( seedCancelled() )
+    return false;
 
   // the matrices init_r_mat and init_t_vec are already set by recoverPose,
   // so we don't need to do anything else here (if results are bad, they will anyway not be used)
@@ -653,49 +834,63 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
 
   cv::triangulatePoints(	proj_mat0, proj_mat1, points0, points1, hpoints4D );
 
+  // Initialize the first optimized points: the shared points are visited in the same order used above
+  // to collect points0 and points1
   int r = 0;
-  // Initialize the first optimized points
-  for( auto const& co_iter : cam_observation_[ref_cam_pose_idx] )
+  obs_index_.forEachShared( ref_cam_pose_idx, new_cam_pose_idx, [&]( int pt_idx, int, int )
   {
-    auto &pt_idx = co_iter.first;
-    if( cam_observation_[new_cam_pose_idx].find(pt_idx ) !=
-        cam_observation_[new_cam_pose_idx].end() )
+    if( inlier_mask_E.at<unsigned char>(r) )
     {
-      if( inlier_mask_E.at<unsigned char>(r) )
-      {
-        // Initialize the new point into the optimization
-        double *pt = pointBlockPtr(pt_idx);
+      // Initialize the new point into the optimization
+      double *pt = pointBlockPtr(pt_idx);
 
-        // H-normalize the point
-        pt[0] = hpoints4D.at<double>(0,r)/hpoints4D.at<double>(3,r);
-        pt[1] = hpoints4D.at<double>(1,r)/hpoints4D.at<double>(3,r);
-        pt[2] = hpoints4D.at<double>(2,r)/hpoints4D.at<double>(3,r);
+      // H-normalize the point
+      pt[0] = hpoints4D.at<double>(0,r)/hpoints4D.at<double>(3,r);
+      pt[1] = hpoints4D.at<double>(1,r)/hpoints4D.at<double>(3,r);
+      pt[2] = hpoints4D.at<double>(2,r)/hpoints4D.at<double>(3,r);
 
-        // Check the cheirality constraint
-        if(pt[2] > 0.0 )
-        {
-          // Try to reproject the estimated 3D point in both cameras
-          cv::Mat_<double> pt_3d = (cv::Mat_<double>(3,1) << pt[0],pt[1],pt[2]);
+      // Check the cheirality constraint
+      if(pt[2] > 0.0 )
+      {
+        // Try to reproject the estimated 3D point in both cameras
+        cv::Mat_<double> pt_3d = (cv::Mat_<double>(3,1) << pt[0],pt[1],pt[2]);
 
-          pt_3d = init_r_mat*pt_3d + init_t_vec;
+        pt_3d = init_r_mat*pt_3d + init_t_vec;
 
-          cv::Point2d p0(pt[0]/pt[2], pt[1]/pt[2]),
-              p1(pt_3d(0,0)/pt_3d(2,0), pt_3d(1,0)/pt_3d(2,0));
+        cv::Point2d p0(pt[0]/pt[2], pt[1]/pt[2]),
+            p1(pt_3d(0,0)/pt_3d(2,0), pt_3d(1,0)/pt_3d(2,0));
 
-          // If the reprojection error is small, add the point to the reconstruction
-          if(cv::norm(p0 - points0[r]) < max_reproj_err_ && cv::norm(p1 - points1[r]) < max_reproj_err_)
-            pts_optim_iter_[pt_idx] = 1;
-          else
-            pts_optim_iter_[pt_idx] = -1;
-        }
+        // If the reprojection error is small, add the point to the reconstruction
+        if(cv::norm(p0 - points0[r]) < max_reproj_err_ && cv::norm(p1 - points1[r]) < max_reproj_err_)
+          pts_optim_iter_[pt_idx] = 1;
+        else
+          pts_optim_iter_[pt_idx] = -1;
       }
     }
     r++;
-  }
+  });
 
   // First bundle adjustment iteration: here we have only two camera poses, i.e., the seed pair
   bundleAdjustmentIter(new_cam_pose_idx );
 
+  return !seedCancelled();
+}
+
+bool BasicSfM::registerCameraPoses()
+{
+  // Canonical camera so identity K
+  cv::Mat_<double> intrinsics_matrix = cv::Mat_<double>::eye(3,3);
+  cv::Mat init_r_vec, init_t_vec;
+  int new_cam_pose_idx;
+
+  // Size of the model at the last global bundle adjustment (the one of the seed pair)
+  auto numRegistered = []( const std::vector<int> &optim_iter )
+  {
+    return static_cast<int>( std::count_if( optim_iter.begin(), optim_iter.end(), []( int it ){ return it > 0; } ) );
+  };
+  int global_ba_cam_poses = numRegistered(cam_pose_optim_iter_), global_ba_points = numRegistered(pts_optim_iter_);
+  bool last_ba_global = true;
+
   // Start to register new poses and observations...
   for(int iter = 1; iter < num_cam_poses_ - 1; iter++ )
   {
@@ -714,7 +909,7 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
     //     for(int i_c = 0; i_c < num_cam_poses_; i_c++ )
     //     {
     //       if( cam_pose_optim_iter_[i_c] == 0 && // New camera pose not yet registered
-    //           cam_observation_[i_c].find( i_p ) != cam_observation_[i_c].end() ) // Dees camera i_c see this 3D point?
+    //           obs_index_.findObservation( i_c, i_p ) >= 0 ) // Dees camera i_c see this 3D point?
     //         n_init_pts[i_c]++;
     //     }
     //   }
@@ -740,14 +935,14 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
     for(int i_c = 0; i_c < num_cam_poses_; i_c++) {
       // Skip already registered or rejected cameras
       if(cam_pose_optim_iter_[i_c] != 0) continue;
-      // Collect indices of registered 3D points seen by camera i_c
-      std::vector<int> pts;
-      for(const auto& obs : cam_observation_[i_c]) {
-        int pt_idx = obs.first;
-        if(pts_optim_iter_[pt_idx] > 0)
-          pts.push_back(pt_idx);
+      // Collect the observations of the registered 3D points seen by camera i_c
+      std::vector<int> pts_obs;
+      ObservationIndex::Entries cam_entries = obs_index_.cameraEntries(i_c);
+      for(int k = 0; k < cam_entries.size; k++) {
+        if(pts_optim_iter_[cam_entries.ids[k]] > 0)
+          pts_obs.push_back(cam_entries.obs[k]);
       }
-      if(pts.empty()) continue;
+      if(pts_obs.empty()) continue;
 
       double score = 0.0;
       // Multi-resolution occupancy grids
@@ -756,8 +951,7 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
         // Occupancy map for this level
         std::vector<std::vector<bool>> occupied(K, std::vector<bool>(K, false));
         double weight = static_cast<double>(K) * static_cast<double>(K);
-        for(int pt_idx : pts) {
-          int obs_idx = cam_observation_[i_c][pt_idx];
+        for(int obs_idx : pts_obs) {
           // Normalized image coordinates
           double x = observations_[2*obs_idx];
           double y = observations_[2*obs_idx + 1];
@@ -785,15 +979,15 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
     // // Extract the 3D points that are projected in the new_cam_pose_idx-th pose and that are already registered
     std::vector<cv::Point3d> scene_pts;
     std::vector<cv::Point2d> img_pts;
-    for( int i_p = 0; i_p < num_points_; i_p++ )
+    ObservationIndex::Entries new_cam_entries = obs_index_.cameraEntries(new_cam_pose_idx);
+    for( int k = 0; k < new_cam_entries.size; k++ )
     {
-      if (pts_optim_iter_[i_p] > 0 &&
-          cam_observation_[new_cam_pose_idx].find(i_p) != cam_observation_[new_cam_pose_idx].end())
+      int i_p = new_cam_entries.ids[k], obs_idx = new_cam_entries.obs[k];
+      if (pts_optim_iter_[i_p] > 0)
       {
         double *pt = pointBlockPtr(i_p);
         scene_pts.emplace_back(pt[0], pt[1], pt[2]);
-        img_pts.emplace_back(observations_[cam_observation_[new_cam_pose_idx][i_p] * 2],
-                             observations_[cam_observation_[new_cam_pose_idx][i_p] * 2 + 1]);
+        img_pts.emplace_back(observations_[obs_idx * 2], observations_[obs_idx * 2 + 1]);
       }
     }
     if( scene_pts.size() <= 3 )
@@ -813,105 +1007,105 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
     int n_new_pts = 0;
     std::vector<cv::Point2d> points0(1), points1(1);
     cv::Mat_<double> proj_mat0(3, 4), proj_mat1(3, 4), hpoints4D;
-    for(int cam_idx = 0; cam_idx < num_cam_poses_; cam_idx++ )
+    // For each point seen by the new camera pose and not yet registered, try to triangulate it with the
+    // registered camera poses that observe it (by increasing index), until the triangulation succeeds
+    for( int k = 0; k < new_cam_entries.size; k++ )
     {
-      if( cam_pose_optim_iter_[cam_idx] > 0 )
+      int pt_idx = new_cam_entries.ids[k], new_obs_idx = new_cam_entries.obs[k];
+      ObservationIndex::Entries pt_entries = obs_index_.pointEntries(pt_idx);
+      for( int l = 0; l < pt_entries.size && pts_optim_iter_[pt_idx] == 0; l++ )
       {
-        for( auto const& co_iter : cam_observation_[cam_idx] )
+        int cam_idx = pt_entries.ids[l], obs_idx = pt_entries.obs[l];
+        if( cam_pose_optim_iter_[cam_idx] <= 0 )
+          continue;
+
+        double *cam0_data = cameraBlockPtr(new_cam_pose_idx),
+            *cam1_data = cameraBlockPtr(cam_idx);
+
+        //////////////////////////// Code to be completed (4/7) /////////////////////////////////
+        // Triangulate the 3D point with index pt_idx by using the observation of this point in the
+        // camera poses with indices new_cam_pose_idx and cam_idx. The pointers cam0_data and cam1_data
+        // point to the 6D pose blocks for these inside the parameters vector (e.g.,
+        // cam0_data[0], cam0_data[1], cam0_data[2] hold the axis-angle representation fo the rotation of the
+        // camera with index new_cam_pose_idx.
+        // Use the OpenCV cv::triangulatePoints() function, remembering to check the cheirality constraint
+        // for both cameras
+        // In case of success (cheirality constrant satisfied) execute the following instructions (decomment e
+        // cut&paste):
+
+        // n_new_pts++;
+        // pts_optim_iter_[pt_idx] = 1;
+        // double *pt = pointBlockPtr(pt_idx);
+        // pt[0] = /*X coordinate of the estimated point */;
+        // pt[1] = /*X coordinate of the estimated point */;
+        // pt[2] = /*X coordinate of the estimated point */;
+        /////////////////////////////////////////////////////////////////////////////////////////
+
+        // get the 2D image points observed in both cameras
+        points0[0] = cv::Point2d(observations_[2 * new_obs_idx],
+                                 observations_[2 * new_obs_idx + 1]);
+        points1[0] = cv::Point2d(observations_[2 * obs_idx],
+                                 observations_[2 * obs_idx + 1]);
+
+        // build the projection matrices for both cameras
+        // convert the axis-angle representation to rotation matrices
+        cv::Mat_<double> R0(3, 3), R1(3, 3);
+        cv::Mat_<double> rvec0 = (cv::Mat_<double>(3, 1) << cam0_data[0], cam0_data[1], cam0_data[2]);
+        cv::Mat_<double> rvec1 = (cv::Mat_<double>(3, 1) << cam1_data[0], cam1_data[1], cam1_data[2]);
+        cv::Rodrigues(rvec0, R0);
+        cv::Rodrigues(rvec1, R1);
+
+        // reate the projection matrices 
+        proj_mat0 = cv::Mat_<double>::zeros(3, 4);
+        proj_mat1 = cv::Mat_<double>::zeros(3, 4);
+        R0.copyTo(proj_mat0(cv::Rect(0, 0, 3, 3)));
+        R1.copyTo(proj_mat1(cv::Rect(0, 0, 3, 3)));
+        proj_mat0(0, 3) = cam0_data[3];
+        proj_mat0(1, 3) = cam0_data[4];
+        proj_mat0(2, 3) = cam0_data[5];
+        proj_mat1(0, 3) = cam1_data[3];
+        proj_mat1(1, 3) = cam1_data[4];
+        proj_mat1(2, 3) = cam1_data[5];
+
+        
+        cv::triangulatePoints(proj_mat0, proj_mat1, points0, points1, hpoints4D);
+
+        // convert homogeneous coordinates to 3D point
+        double X = hpoints4D.at<double>(0, 0) / hpoints4D.at<double>(3, 0);
+        double Y = hpoints4D.at<double>(1, 0) / hpoints4D.at<double>(3, 0);
+        double Z = hpoints4D.at<double>(2, 0) / hpoints4D.at<double>(3, 0);
+
+        // check the cheirality constraint for both cameras
+        bool cheirality0 = checkCheiralityConstraint(new_cam_pose_idx, pt_idx);
+
+        // temporary  variables
+        double *pt_temp = pointBlockPtr(pt_idx);
+        double backup[3] = {pt_temp[0], pt_temp[1], pt_temp[2]};
+        pt_temp[0] = X;
+        pt_temp[1] = Y;
+        pt_temp[2] = Z;
+
+        bool cheirality1 = checkCheiralityConstraint(cam_idx, pt_idx);
+
+        // if the point passes the cheirality constraint for both cameras keep it
+        if (cheirality0 && cheirality1 && Z > 0)
         {
-          auto &pt_idx = co_iter.first;
-          if( pts_optim_iter_[pt_idx] == 0 &&
-              cam_observation_[new_cam_pose_idx].find(pt_idx ) != cam_observation_[new_cam_pose_idx].end() )
-          {
-            double *cam0_data = cameraBlockPtr(new_cam_pose_idx),
-                *cam1_data = cameraBlockPtr(cam_idx);
-
-            //////////////////////////// Code to be completed (4/7) /////////////////////////////////
-            // Triangulate the 3D point with index pt_idx by using the observation of this point in the
-            // camera poses with indices new_cam_pose_idx and cam_idx. The pointers cam0_data and cam1_data
-            // point to the 6D pose blocks for these inside the parameters vector (e.g.,
-            // cam0_data[0], cam0_data[1], cam0_data[2] hold the axis-angle representation fo the rotation of the
-            // camera with index new_cam_pose_idx.
-            // Use the OpenCV cv::triangulatePoints() function, remembering to check the cheirality constraint
-            // for both cameras
-            // In case of success (cheirality constrant satisfied) execute the following instructions (decomment e
-            // cut&paste):
-
-            // n_new_pts++;
-            // pts_optim_iter_[pt_idx] = 1;
-            // double *pt = pointBlockPtr(pt_idx);
-            // pt[0] = /*X coordinate of the estimated point */;
-            // pt[1] = /*X coordinate of the estimated point */;
-            // pt[2] = /*X coordinate of the estimated point */;
-            /////////////////////////////////////////////////////////////////////////////////////////
-
-            // get the 2D image points observed in both cameras
-            points0[0] = cv::Point2d(observations_[2 * cam_observation_[new_cam_pose_idx][pt_idx]],
-                                     observations_[2 * cam_observation_[new_cam_pose_idx][pt_idx] + 1]);
-            points1[0] = cv::Point2d(observations_[2 * co_iter.second],
-                                     observations_[2 * co_iter.second + 1]);
-
-            // build the projection matrices for both cameras
-            // convert the axis-angle representation to rotation matrices
-            cv::Mat_<double> R0(3, 3), R1(3, 3);
-            cv::Mat_<double> rvec0 = (cv::Mat_<double>(3, 1) << cam0_data[0], cam0_data[1], cam0_data[2]);
-            cv::Mat_<double> rvec1 = (cv::Mat_<double>(3, 1) << cam1_data[0], cam1_data[1], cam1_data[2]);
-            cv::Rodrigues(rvec0, R0);
-            cv::Rodrigues(rvec1, R1);
-
-            // reate the projection matrices 
-            proj_mat0 = cv::Mat_<double>::zeros(3, 4);
-            proj_mat1 = cv::Mat_<double>::zeros(3, 4);
-            R0.copyTo(proj_mat0(cv::Rect(0, 0, 3, 3)));
-            R1.copyTo(proj_mat1(cv::Rect(0, 0, 3, 3)));
-            proj_mat0(0, 3) = cam0_data[3];
-            proj_mat0(1, 3) = cam0_data[4];
-            proj_mat0(2, 3) = cam0_data[5];
-            proj_mat1(0, 3) = cam1_data[3];
-            proj_mat1(1, 3) = cam1_data[4];
-            proj_mat1(2, 3) = cam1_data[5];
-
-            
-            cv::triangulatePoints(proj_mat0, proj_mat1, points0, points1, hpoints4D);
-
-            // convert homogeneous coordinates to 3D point
-            double X = hpoints4D.at<double>(0, 0) / hpoints4D.at<double>(3, 0);
-            double Y = hpoints4D.at<double>(1, 0) / hpoints4D.at<double>(3, 0);
-            double Z = hpoints4D.at<double>(2, 0) / hpoints4D.at<double>(3, 0);
-
-            // check the cheirality constraint for both cameras
-            bool cheirality0 = checkCheiralityConstraint(new_cam_pose_idx, pt_idx);
-
-            // temporary  variables
-            double *pt_temp = pointBlockPtr(pt_idx);
-            double backup[3] = {pt_temp[0], pt_temp[1], pt_temp[2]};
-            pt_temp[0] = X;
-            pt_temp[1] = Y;
-            pt_temp[2] = Z;
-
-            bool cheirality1 = checkCheiralityConstraint(cam_idx, pt_idx);
-
-            // if the point passes the cheirality constraint for both cameras keep it
-            if (cheirality0 && cheirality1 && Z > 0)
-            {
-              n_new_pts++;
-              pts_optim_iter_[pt_idx] = 1;
-              double *pt = pointBlockPtr(pt_idx);
-              pt[0] = X;
-              pt[1] = Y;
-              pt[2] = Z;
-            }
-            else
-            {
-              // restore the backup (will be zeroed out anyway)
-              pt_temp[0] = backup[0];
-              pt_temp[1] = backup[1];
-              pt_temp[2] = backup[2];
-            }
-
-            /////////////////////////////////////////////////////////////////////////////////////////
-          }
+          n_new_pts++;
+          pts_optim_iter_[pt_idx] = 1;
+          double *pt = pointBlockPtr(pt_idx);
+          pt[0] = X;
+          pt[1] = Y;
+          pt[2] = Z;
+        }
+        else
+        {
+          // restore the backup (will be zeroed out anyway)
+          pt_temp[0] = backup[0];
+          pt_temp[1] = backup[1];
+          pt_temp[2] = backup[2];
         }
+
+        /////////////////////////////////////////////////////////////////////////////////////////
       }
     }
 
@@ -924,8 +1118,24 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
     //added this line
     std::vector<double> bck_parameters = parameters_;
 
-    // Execute an iteration of bundle adjustment
-    bundleAdjustmentIter(new_cam_pose_idx);
+    // Execute an iteration of bundle adjustment: a global one if the model has grown enough since the last
+    // one (or if local bundle adjustment is disabled), a local one otherwise
+    int num_cam_poses = numRegistered(cam_pose_optim_iter_), num_points = numRegistered(pts_optim_iter_);
+    last_ba_global = local_ba_neighbors_ <= 0 ||
+                     num_cam_poses >= ( 1.0 + global_ba_growth_ )*global_ba_cam_poses ||
+                     num_points >= ( 1.0 + global_ba_growth_ )*global_ba_points;
+    bool ba_solved = bundleAdjustmentIter(new_cam_pose_idx, last_ba_global);
+    if( last_ba_global && !ba_solved )
+    {
+      // Try again at the next camera pose (or at the end)
+      std::cout<<"Global bundle adjustment failed"<<std::endl;
+      last_ba_global = false;
+    }
+    else if( last_ba_global )
+    {
+      global_ba_cam_poses = num_cam_poses;
+      global_ba_points = num_points;
+    }
 
     Eigen::Vector3d vol_min = Eigen::Vector3d::Constant((std::numeric_limits<double>::max())),
                     vol_max = Eigen::Vector3d::Constant((-std::numeric_limits<double>::max()));
@@ -1110,6 +1320,14 @@ bool BasicSfM::incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1
     /////////////////////////////////////////////////////////////////////////////////////////
   }
 
+  // Final global bundle adjustment
+  if( !last_ba_global )
+  {
+    std::cout<<"Final global bundle adjustment"<<std::endl;
+    if( !bundleAdjustmentIter(new_cam_pose_idx, true) )
+      std::cout<<"Final global bundle adjustment failed, the last local solutions are kept"<<std::endl;
+  }
+
   return true;
 }
 
@@ -1125,74 +1343,229 @@ void BasicSfM::initCamParams(int new_pose_idx, cv::Mat r_vec, cv::Mat t_vec)
   }
 }
 
-void BasicSfM::bundleAdjustmentIter(int new_cam_idx)
+void BasicSfM::updateBundleAdjustmentProblem()
 {
+  if( !ba_.problem )
+  {
+    ceres::Problem::Options problem_options;
+    problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    // The rejected points are removed along with their residual blocks
+    problem_options.enable_fast_removal = true;
+    ba_.problem.reset( new ceres::Problem(problem_options) );
+    ba_.ordering = std::make_shared<ceres::ParameterBlockOrdering>();
+    ba_.residuals.assign(num_observations_, nullptr);
+    ba_.cam_poses_added.assign(num_cam_poses_, 0);
+    ba_.points_added.assign(num_points_, 0);
+  }
+  if( !ba_.loss )
+    ba_.loss.reset( new ceres::CauchyLoss( 2*max_reproj_err_) );
+  ba_.cost_functions.resize(num_observations_);
+
+  for( int i_pt = 0; i_pt < num_points_; i_pt++ )
+  {
+    double *point = pointBlockPtr(i_pt);
+    ObservationIndex::Entries pt_entries = obs_index_.pointEntries(i_pt);
+    if( pts_optim_iter_[i_pt] <= 0 )
+    {
+      if( ba_.points_added[i_pt] )
+      {
+        ba_.problem->RemoveParameterBlock(point);
+        ba_.ordering->Remove(point);
+        ba_.points_added[i_pt] = 0;
+        for( int k = 0; k < pt_entries.size; k++ )
+          ba_.residuals[pt_entries.obs[k]] = nullptr;
+      }
+      continue;
+    }
+
+    // Add the observations of this point from the registered camera poses not yet in the problem
+    for( int k = 0; k < pt_entries.size; k++ )
+    {
+      int i_cam = pt_entries.ids[k], i_obs = pt_entries.obs[k];
+      if( cam_pose_optim_iter_[i_cam] <= 0 || ba_.residuals[i_obs] )
+        continue;
+
+      std::unique_ptr<ceres::CostFunction> &cost_function = ba_.cost_functions[i_obs];
+      if( !cost_function )
+        cost_function.reset( ReprojectionError::Create(observations_[2*i_obs], observations_[2*i_obs + 1]) );
+      double *camera = cameraBlockPtr(i_cam);
+      ba_.residuals[i_obs] = ba_.problem->AddResidualBlock( cost_function.get(), ba_.loss.get(), camera, point );
+
+      if( !ba_.cam_poses_added[i_cam] )
+      {
+        ba_.ordering->AddElementToGroup(camera, 1);
+        ba_.cam_poses_added[i_cam] = 1;
+        // the first camera pose is fixed to avoid gauge freedom
+        if( i_cam == 0 )
+          ba_.problem->SetParameterBlockConstant(camera);
+      }
+      if( !ba_.points_added[i_pt] )
+      {
+        ba_.ordering->AddElementToGroup(point, 0);
+        ba_.points_added[i_pt] = 1;
+      }
+    }
+  }
+}
+
+void BasicSfM::localWindow( int new_cam_idx, std::vector<char> &window_cam_poses ) const
+{
+  // Count the registered points shared by the new camera pose with each registered pose
+  std::vector<int> num_shared(num_cam_poses_, 0);
+  ObservationIndex::Entries cam_entries = obs_index_.cameraEntries(new_cam_idx);
+  for( int k = 0; k < cam_entries.size; k++ )
+  {
+    if( pts_optim_iter_[cam_entries.ids[k]] <= 0 )
+      continue;
+    ObservationIndex::Entries pt_entries = obs_index_.pointEntries(cam_entries.ids[k]);
+    for( int l = 0; l < pt_entries.size; l++ )
+    {
+      if( cam_pose_optim_iter_[pt_entries.ids[l]] > 0 )
+        num_shared[pt_entries.ids[l]]++;
+    }
+  }
+  num_shared[new_cam_idx] = 0;
+
+  std::vector<int> neighbors;
+  for( int i_cam = 0; i_cam < num_cam_poses_; i_cam++ )
+  {
+    if( num_shared[i_cam] > 0 )
+      neighbors.push_back(i_cam);
+  }
+  int num_neighbors = std::min( local_ba_neighbors_, static_cast<int>(neighbors.size()) );
+  std::partial_sort( neighbors.begin(), neighbors.begin() + num_neighbors, neighbors.end(),
+                     [&num_shared]( int c0, int c1 )
+                     { return num_shared[c0] > num_shared[c1] || ( num_shared[c0] == num_shared[c1] && c0 < c1 ); } );
+
+  window_cam_poses.assign(num_cam_poses_, 0);
+  window_cam_poses[new_cam_idx] = 1;
+  for( int k = 0; k < num_neighbors; k++ )
+    window_cam_poses[neighbors[k]] = 1;
+}
+
+void BasicSfM::setBundleAdjustmentWindow( const std::vector<char> &window_cam_poses )
+{
+  const bool global = window_cam_poses.empty();
+  for( int i_cam = 0; i_cam < num_cam_poses_; i_cam++ )
+  {
+    if( !ba_.cam_poses_added[i_cam] )
+      continue;
+    if( i_cam == 0 || ( !global && !window_cam_poses[i_cam] ) )
+      ba_.problem->SetParameterBlockConstant(cameraBlockPtr(i_cam));
+    else
+      ba_.problem->SetParameterBlockVariable(cameraBlockPtr(i_cam));
+  }
+
+  // The points observed by the window camera poses are optimized, the residual blocks of the other points
+  // depend only on constant blocks and are skipped by the solver
+  std::vector<char> window_points;
+  if( !global )
+  {
+    window_points.assign(num_points_, 0);
+    for( int i_cam = 0; i_cam < num_cam_poses_; i_cam++ )
+    {
+      if( !window_cam_poses[i_cam] )
+        continue;
+      ObservationIndex::Entries cam_entries = obs_index_.cameraEntries(i_cam);
+      for( int k = 0; k < cam_entries.size; k++ )
+        window_points[cam_entries.ids[k]] = 1;
+    }
+  }
+  for( int i_pt = 0; i_pt < num_points_; i_pt++ )
+  {
+    if( !ba_.points_added[i_pt] )
+      continue;
+    if( global || window_points[i_pt] )
+      ba_.problem->SetParameterBlockVariable(pointBlockPtr(i_pt));
+    else
+      ba_.problem->SetParameterBlockConstant(pointBlockPtr(i_pt));
+  }
+}
+
+void BasicSfM::resetBundleAdjustmentProblem()
+{
+  ba_.problem.reset();
+  ba_.ordering.reset();
+  std::vector<ceres::ResidualBlockId>().swap(ba_.residuals);
+  std::vector<char>().swap(ba_.cam_poses_added);
+  std::vector<char>().swap(ba_.points_added);
+}
+
+bool BasicSfM::bundleAdjustmentIter(int new_cam_idx, bool global)
+{
+  std::vector<char> window_cam_poses;
+  if( !global )
+    localWindow(new_cam_idx, window_cam_poses);
+
   ceres::Solver::Options options;
   options.linear_solver_type = ceres::DENSE_SCHUR;
   options.minimizer_progress_to_stdout = false;
-  options.num_threads = 4; 
+  options.num_threads = ( ba_num_threads_ > 0 ) ? ba_num_threads_ : resolveNumThreads(num_threads_);
   options.max_num_iterations = 200;
+  // Seed pair evaluated by a worker: stop as soon as it is cancelled
+  std::unique_ptr<CancelCallback> cancel_callback;
+  if( seed_cancel_ )
+  {
+    cancel_callback.reset( new CancelCallback(seed_cancel_) );
+    options.callbacks.push_back(cancel_callback.get());
+  }
 
   std::vector<double> bck_parameters;
 
-  bool keep_optimize = true;
+  bool keep_optimize = true, solved = true;
 
   // Global optimization
   while (keep_optimize)
   {
     bck_parameters = parameters_;
-    ceres::Problem problem;
     ceres::Solver::Summary summary;
 
-    // For each observation....
-    for( int i_obs = 0; i_obs < num_observations_; i_obs++ )
-    {
-      //.. check if this observation has bem already registered (both checking camera pose and point pose)
-      if( cam_pose_optim_iter_[cam_pose_index_[i_obs]] > 0 && pts_optim_iter_[point_index_[i_obs]] > 0 )
-      {
-        //////////////////////////// Code to be completed (6/7) /////////////////////////////////
-        //... in case, add a residual block inside the Ceres solver problem.
-        // You should define a suitable functor (i.e., see the ReprojectionError struct at the
-        // beginning of this file)
-        // You may try a Cauchy loss function with parameters, say, 2*max_reproj_err_
-        // Remember that the parameter blocks are stored starting from the
-        // parameters_.data() double* pointer.
-        // The camera position blocks have size (camera_block_size_) of 6 elements,
-        // while the point position blocks have size (point_block_size_) of 3 elements.
-        //////////////////////////////////////////////////////////////////////////////////
-
-        // get the observation values 
-        double *observation = observations_.data() + (i_obs * 2);
-        double observed_x = observation[0];
-        double observed_y = observation[1];
-
-        double *camera = cameraBlockPtr(cam_pose_index_[i_obs]);
-        double *point = pointBlockPtr(point_index_[i_obs]);
-
-        // cost function based on the ReprojectionError struct
-        ceres::CostFunction *cost_function = ReprojectionError::Create(observed_x, observed_y);
-
-        // residual block 
-        problem.AddResidualBlock(
-            cost_function,                            
-            new ceres::CauchyLoss( 2*max_reproj_err_), //*2 prima 
-            camera,                                     
-            point                                       
-        );
+    //////////////////////////// Code to be completed (6/7) /////////////////////////////////
+    //... in case, add a residual block inside the Ceres solver problem.
+    // You should define a suitable functor (i.e., see the ReprojectionError struct at the
+    // beginning of this file)
+    // You may try a Cauchy loss function with parameters, say, 2*max_reproj_err_
+    // Remember that the parameter blocks are stored starting from the
+    // parameters_.data() double* pointer.
+    // The camera position blocks have size (camera_block_size_) of 6 elements,
+    // while the point position blocks have size (point_block_size_) of 3 elements.
+    //////////////////////////////////////////////////////////////////////////////////
+
+    // The problem persists across the iterations: only the new observations are added, and the points
+    // penalized by the previous iteration are removed
+    updateBundleAdjustmentProblem();
+    setBundleAdjustmentWindow(window_cam_poses);
+    // The solver removes the constant blocks from the ordering it is given: pass a copy, the persistent
+    // ordering must keep all the parameter blocks of the problem
+    options.linear_solver_ordering = std::make_shared<ceres::ParameterBlockOrdering>(*ba_.ordering);
 
-        // the first camera pose is fixed to avoid gauge freedom
-        if (cam_pose_index_[i_obs] == 0)
-        {
-          problem.SetParameterBlockConstant(camera);
-        }
-        
-        /////////////////////////////////////////////////////////////////////////////////////////
+    /////////////////////////////////////////////////////////////////////////////////////////
 
+    Solve(options, ba_.problem.get(), &summary);
+    if( seedCancelled() )
+      return false;
+
+    if( !summary.IsSolutionUsable() )
+    {
+      // Fall back to the ordering computed by the solver
+      std::cerr<<"Bundle adjustment failed ("<<summary.BriefReport()<<"), retrying with the default ordering"
+               <<std::endl;
+      std::copy(bck_parameters.begin(), bck_parameters.end(), parameters_.begin());
+      options.linear_solver_ordering.reset();
+      Solve(options, ba_.problem.get(), &summary);
+      if( seedCancelled() )
+        return false;
+      if( !summary.IsSolutionUsable() )
+      {
+        std::cerr<<"Bundle adjustment failed ("<<summary.BriefReport()<<"), parameters left unchanged"
+                 <<std::endl;
+        std::copy(bck_parameters.begin(), bck_parameters.end(), parameters_.begin());
+        solved = false;
+        break;
       }
     }
 
-    Solve(options, &problem, &summary);
-
     // WARNING Here poor optimization ... :(
     // CHeck the cheirality constraint
     int n_cheirality_violation = 0;
@@ -1212,18 +1585,19 @@ void BasicSfM::bundleAdjustmentIter(int new_cam_idx)
     if( n_cheirality_violation > max_outliers_ )
     {
       std::cout << "****************** OPTIM CHEIRALITY VIOLATION for " << n_cheirality_violation << " points : redoing optim!!" << std::endl;
-      parameters_ = bck_parameters;
+      std::copy(bck_parameters.begin(), bck_parameters.end(), parameters_.begin());
     }
     else if ( (n_outliers = rejectOuliers()) > max_outliers_ )
     {
       std::cout<<"****************** OPTIM FOUND "<<n_outliers<<" OUTLIERS : redoing optim!!"<<std::endl;
-      parameters_ = bck_parameters;
+      std::copy(bck_parameters.begin(), bck_parameters.end(), parameters_.begin());
     }
     else
       keep_optimize = false;
   }
 
   printPose ( new_cam_idx );
+  return solved;
 }
 
 int BasicSfM:: rejectOuliers()
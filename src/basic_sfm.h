@@ -2,11 +2,16 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "Eigen/Dense"
 #include <opencv2/opencv.hpp>
+#include <ceres/ceres.h>
+
+#include "observation_index.h"
 
 class BasicSfM
 {
@@ -20,6 +25,8 @@ class BasicSfM
   // solution of the reconstruction problem, hence load it
   // If load_colors is set to true, it is assumed that the input file also includes the RGB colors of the
   // 3D points, hence load them
+  // Both the text data file and the binary one (see BinaryDataFile) are supported, the format is detected
+  // from the file content
   void readFromFile(const std::string& filename, bool load_initial_guess = false, bool load_colors = false );
   // Write data to file, if write_unoptimized is set to true, also the optimized parameters (camera and points
   // positions) are stored to file
@@ -37,14 +44,76 @@ class BasicSfM
   // Clear everything
   void reset();
 
+  // Number of threads used to compute the co-visibility between camera poses, to evaluate the seed pair
+  // candidates and by the bundle adjustments (<= 0: all the available cores)
+  void setNumThreads( int num_threads ) { num_threads_ = num_threads; };
+
+  // Number of seed pair candidates (the ones with more correspondences) evaluated concurrently (default: 1,
+  // the seed pairs are tried one at a time). Each candidate is initialized on its own copy of the
+  // reconstruction, then the reconstruction continues from the one with more registered points
+  void setNumSeedCandidates( int num_candidates ) { num_seed_candidates_ = num_candidates; };
+
+  // Local bundle adjustment: after registering a camera pose, optimize only that pose, its num_neighbors most
+  // co-visible registered poses and the points they observe, holding the rest constant (num_neighbors <= 0,
+  // the default, optimizes everything every time). A global bundle adjustment is still run whenever the
+  // registered poses or points have grown by global_growth (e.g., 0.1 for 10%) since the last global one,
+  // and once at the end
+  void setLocalBundleAdjustment( int num_neighbors, double global_growth = 0.1 )
+  {
+    local_ba_neighbors_ = num_neighbors;
+    global_ba_growth_ = global_growth;
+  };
+
  private:
 
+  // Load the data from a binary data file (see readFromFile())
+  void readFromBinaryFile( const std::string& filename, bool load_initial_guess, bool load_colors );
+
   // Given a seed pair, perform incremental mapping via iterations composed by PnP-based image registration,
   // triangulation of new points, and bundle adjustment
   bool incrementalReconstruction( int seed_pair_idx0, int seed_pair_idx1 );
 
-  // Refine camera and point positions registered so far inside a global optimization problem
-  void bundleAdjustmentIter( int new_cam_idx );
+  // Start a new reconstruction from a seed pair: two-view geometry, triangulation of the shared points and
+  // first bundle adjustment. Return false if the seed pair is not suitable, or if its evaluation has been
+  // cancelled
+  bool initializeSeedPair( int seed_pair_idx0, int seed_pair_idx1 );
+
+  // Register the remaining camera poses one at a time, starting from an initialized seed pair
+  bool registerCameraPoses();
+
+  // Initialize the seed pair candidates concurrently, each one inside its own worker (a copy of this object,
+  // workers are created once and reused). On output, scores[i] is the number of points registered by the
+  // i-th candidate, -1 if it is not suitable and -2 if its evaluation has been cancelled since it could not
+  // beat another candidate
+  void evaluateSeedCandidates( const std::vector<ObservationIndex::CoVisibility> &candidates,
+                               std::vector< std::unique_ptr<BasicSfM> > &workers, std::vector<int> &scores );
+
+  // Exchange the parameters and the registration masks with another object built from the same data
+  void swapReconstructionState( BasicSfM &other );
+
+  // True if the evaluation of the current seed pair has been cancelled
+  bool seedCancelled() const { return seed_cancel_ && seed_cancel_->load(); };
+
+  // Refine camera and point positions registered so far inside a global optimization problem, or (if global
+  // is false) only the ones inside the local window of the new_cam_idx-th camera pose. Return false if the
+  // solver could not find a usable solution (the parameters are left unchanged) or if it has been cancelled
+  bool bundleAdjustmentIter( int new_cam_idx, bool global = true );
+
+  // Select the camera poses of the local window of the new_cam_idx-th pose (itself and its local_ba_neighbors_
+  // registered poses with more shared registered points), setting window_cam_poses[i] to 1 for them
+  void localWindow( int new_cam_idx, std::vector<char> &window_cam_poses ) const;
+
+  // Set the parameter blocks of the bundle adjustment problem as variable if they belong to the window
+  // (the camera poses in window_cam_poses and the points they observe), constant otherwise. An empty window
+  // means the whole problem. The first camera pose is always constant
+  void setBundleAdjustmentWindow( const std::vector<char> &window_cam_poses );
+
+  // Bring the bundle adjustment problem up to date with the registered camera poses and points: add the
+  // residual blocks of the new observations, and remove the rejected points along with their residual blocks
+  void updateBundleAdjustmentProblem();
+
+  // Drop the bundle adjustment problem, e.g. when starting a new reconstruction (the cost functions are kept)
+  void resetBundleAdjustmentProblem();
 
   // A simple strategy for eliminating outliers: just check the projection error of each point in each view,
   // if is greater than max_reproj_err_, remove the point from the solution
@@ -106,9 +175,10 @@ class BasicSfM
   const int camera_block_size_ = 6;
   const int point_block_size_ = 3;
 
-  // For each camera pose, cam_observation_ that reports the pairs [point index, observation index]
-  // This map is used to quickly retrieve the observation index given a 3D point index
-  std::vector< std::map<int,int> > cam_observation_;
+  // Observations indexed by camera pose (pairs [point index, observation index]) and by 3D point (pairs
+  // [camera pose index, observation index]), used to quickly retrieve the observation index given a camera pose
+  // and a 3D point, and the points shared by two camera poses
+  ObservationIndex obs_index_;
 
   // For each camera pose, the number of optimization iterations (0 if it has not yet been estimated,
   // -1 if the pose has been rejected)
@@ -121,4 +191,33 @@ class BasicSfM
   double max_reproj_err_ = 0.01;
   // Maximum number of outliers that we can tolerate without re-optimizing all
   int max_outliers_ = 5;
+  int num_threads_ = 0;
+  // Threads of the bundle adjustments of a seed candidate worker, i.e., its share of num_threads_ (<= 0: all
+  // the num_threads_ threads)
+  int ba_num_threads_ = 0;
+  int num_seed_candidates_ = 1;
+  int local_ba_neighbors_ = 0;
+  double global_ba_growth_ = 0.1;
+  // Cancellation flag of the seed pair evaluated by a worker (see evaluateSeedCandidates())
+  const std::atomic<bool> *seed_cancel_ = nullptr;
+
+  // Bundle adjustment problem kept across the bundleAdjustmentIter() calls of a reconstruction. It does not own
+  // its cost functions (one per observation, created once) and the shared loss function, that are reused
+  // by the next problems. Copies start empty, since the problem refers to the parameters_ of its owner
+  struct BundleAdjustmentState
+  {
+    BundleAdjustmentState() = default;
+    BundleAdjustmentState( const BundleAdjustmentState & ) {};
+    BundleAdjustmentState &operator=( const BundleAdjustmentState & ) { return *this; };
+
+    std::unique_ptr<ceres::Problem> problem;
+    // Schur elimination ordering (points first, then camera poses), updated along with the problem
+    std::shared_ptr<ceres::ParameterBlockOrdering> ordering;
+    std::unique_ptr<ceres::LossFunction> loss;
+    std::vector< std::unique_ptr<ceres::CostFunction> > cost_functions;
+    // Residual block of each observation (nullptr if it is not in the problem)
+    std::vector<ceres::ResidualBlockId> residuals;
+    std::vector<char> cam_poses_added, points_added;
+  };
+  BundleAdjustmentState ba_;
 };
@@ -0,0 +1,122 @@
+#include "descriptor_spill.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+
+DescriptorSpill::~DescriptorSpill()
+{
+  if( fptr_ )
+    fclose(fptr_);
+  if( fptr_ || failed_ )
+    std::remove(filename_.c_str());
+}
+
+bool DescriptorSpill::create( const std::string &dir )
+{
+  boost::system::error_code ec;
+  boost::filesystem::path dir_path = dir.empty() ? boost::filesystem::temp_directory_path(ec) :
+                                                   boost::filesystem::path(dir);
+  if( ec )
+  {
+    std::cerr<<"Can't find the temporary directory : "<<ec.message()<<std::endl;
+    return false;
+  }
+
+  std::string name_template = (dir_path/"sfm_descriptors_XXXXXX").string();
+  std::vector<char> name(name_template.begin(), name_template.end());
+  name.push_back('\0');
+  int fd = mkstemp(name.data());
+  if( fd < 0 || !(fptr_ = fdopen(fd, "wb")) )
+  {
+    if( fd >= 0 )
+      close(fd);
+    std::cerr<<"Error: unable to create the descriptors spill file in "<<dir_path.string()<<std::endl;
+    return false;
+  }
+  filename_ = name.data();
+  failed_ = false;
+  size_ = 0;
+  blocks_.clear();
+  return true;
+}
+
+bool DescriptorSpill::append( int idx, const cv::Mat &descriptors )
+{
+  if( !fptr_ )
+    return false;
+
+  static const char zeros[4096] = {};
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t row_size = descriptors.cols*descriptors.elemSize();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t offset = (size_ + page_size - 1)/page_size*page_size;
+  // Padding up to the page boundary, in chunks of the zeros buffer (the pages can be larger than it)
+  bool ok = true;
+  for( uint64_t pos = size_; ok && pos < offset; )
+  {
+    size_t chunk = static_cast<size_t>( std::min<uint64_t>( offset - pos, sizeof(zeros) ) );
+    ok = fwrite(zeros, 1, chunk, fptr_) == chunk;
+    pos += chunk;
+  }
+  for( int r = 0; ok && r < descriptors.rows; r++ )
+    ok = fwrite(descriptors.ptr(r), 1, row_size, fptr_) == row_size;
+  if( !ok )
+  {
+    std::cerr<<"Error: unable to write the descriptors spill file "<<filename_
+             <<", the next descriptors are kept in memory"<<std::endl;
+    // The file position is unknown now, no more descriptors can be appended. The file is kept, since the
+    // previous blocks are read back by map()
+    fclose(fptr_);
+    fptr_ = nullptr;
+    failed_ = true;
+    return false;
+  }
+
+  size_ = offset + descriptors.rows*row_size;
+  blocks_.push_back( { idx, descriptors.rows, descriptors.cols, descriptors.type(), offset } );
+  return true;
+}
+
+bool DescriptorSpill::map( std::vector<cv::Mat> &descriptors,
+                           std::vector< std::shared_ptr<const MappedFile> > &files )
+{
+  if( !fptr_ && !failed_ )
+    return blocks_.empty();
+
+  if( fptr_ && fclose(fptr_) != 0 )
+    std::cerr<<"Error: unable to write the descriptors spill file "<<filename_<<std::endl;
+  fptr_ = nullptr;
+  failed_ = false;
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+  // A file with only empty descriptors can't be mapped, but there is nothing to map anyway
+  bool mapped = size_ && file->open(filename_);
+  if( size_ && !mapped )
+    std::cerr<<"Error: unable to map the descriptors spill file "<<filename_<<std::endl;
+  // The mapping stays valid after removing the file, so it is never left behind
+  std::remove(filename_.c_str());
+
+  // The file is written sequentially: after a failure, the blocks that end inside it are complete
+  int num_lost = 0;
+  for( const Block &b : blocks_ )
+  {
+    uint64_t block_size = static_cast<uint64_t>(b.rows)*b.cols*CV_ELEM_SIZE(b.type);
+    if( !b.rows )
+      descriptors[b.idx] = cv::Mat( 0, b.cols, b.type );
+    else if( mapped && b.offset + block_size <= file->size() )
+      descriptors[b.idx] = cv::Mat( b.rows, b.cols, b.type, const_cast<uint8_t *>(file->data() + b.offset) );
+    else
+    {
+      std::cerr<<"Error: the spilled descriptors of image "<<b.idx<<" are lost"<<std::endl;
+      descriptors[b.idx] = cv::Mat( 0, b.cols, b.type );
+      num_lost++;
+      continue;
+    }
+    files[b.idx] = mapped ? file : nullptr;
+  }
+  blocks_.clear();
+  return num_lost == 0;
+}
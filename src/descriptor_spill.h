@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "io_utils.h"
+
+// Temporary file where the descriptors of the images are spilled while they are extracted, so that they do
+// not stay in memory. Once all the images are processed, the file is memory mapped and the descriptors are
+// used in place: their pages are loaded on demand (see MappedFile::advise()), and the memory used by the
+// descriptors is bounded by the ones accessed at the same time, not by the number of images.
+// The descriptors of each image start at a page boundary, so they can be released independently
+class DescriptorSpill
+{
+ public:
+
+  DescriptorSpill() = default;
+  ~DescriptorSpill();
+
+  DescriptorSpill( const DescriptorSpill & ) = delete;
+  DescriptorSpill &operator=( const DescriptorSpill & ) = delete;
+
+  // Create the temporary file in the dir directory (if empty, in the system temporary directory).
+  // Return false on failure
+  bool create( const std::string &dir = std::string() );
+
+  // Append the descriptors of the idx-th image, return false on failure (the caller keeps the descriptors in
+  // memory). After a failed write no more descriptors are appended. It can be called from multiple threads
+  bool append( int idx, const cv::Mat &descriptors );
+
+  // Close the file and map it: for each appended image, descriptors[idx] is set to point inside the mapping
+  // and files[idx] to the mapping itself, that is kept alive by the files pointers (the file is deleted
+  // once mapped). After a failed write (or close), the blocks fully written before it are still mapped.
+  // Return false if the descriptors of some appended images are lost: they are set to empty descriptors
+  bool map( std::vector<cv::Mat> &descriptors, std::vector< std::shared_ptr<const MappedFile> > &files );
+
+ private:
+
+  struct Block
+  {
+    int idx, rows, cols, type;
+    uint64_t offset;
+  };
+
+  FILE *fptr_ = nullptr;
+  // True after a failed write: the file is closed but still holds the blocks written before
+  bool failed_ = false;
+  std::string filename_;
+  uint64_t size_ = 0;
+  std::vector<Block> blocks_;
+  std::mutex mutex_;
+};
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "hamming_matcher.h"
+
+// Descriptor traits: element type, length, size in bytes and distance metric of the descriptors computed
+// by a feature backend. The distance functions have a loop of compile-time length, so the compiler fully
+// unrolls (and vectorizes) them. rawDistance() is used to rank the neighbors, distance() converts it
+// into the metric distance (e.g., the same values of cv::BFMatcher)
+
+// Binary descriptors of num_bytes bytes, compared with the Hamming distance
+template <int num_bytes>
+struct BinaryDescriptorTraits
+{
+  typedef uint8_t ElemType;
+  typedef int RawDistance;
+  static const int length = num_bytes;
+  static const int bytes = num_bytes;
+  static const int cv_type = CV_8U;
+  static const bool binary = true;
+
+  static RawDistance rawDistance( const ElemType *a, const ElemType *b )
+  {
+    int dist = 0, k = 0;
+    for( ; k + 8 <= num_bytes; k += 8 )
+    {
+      uint64_t wa, wb;
+      memcpy(&wa, a + k, sizeof(wa));
+      memcpy(&wb, b + k, sizeof(wb));
+      dist += __builtin_popcountll(wa ^ wb);
+    }
+    for( ; k < num_bytes; k++ )
+      dist += __builtin_popcount(a[k] ^ b[k]);
+    return dist;
+  }
+
+  static float distance( RawDistance raw_dist ) { return static_cast<float>(raw_dist); };
+};
+
+// Descriptors of num_elems unsigned bytes (e.g., SIFT, whose values are integers in [0, 255]) compared
+// with the L2 distance
+template <int num_elems>
+struct L2DescriptorTraits
+{
+  typedef uint8_t ElemType;
+  typedef int RawDistance;
+  static const int length = num_elems;
+  static const int bytes = num_elems;
+  static const int cv_type = CV_8U;
+  static const bool binary = false;
+
+  // Squared L2 distance (exact, in integer arithmetic)
+  static RawDistance rawDistance( const ElemType *a, const ElemType *b )
+  {
+    int dist = 0;
+    for( int k = 0; k < num_elems; k++ )
+    {
+      int diff = static_cast<int>(a[k]) - static_cast<int>(b[k]);
+      dist += diff*diff;
+    }
+    return dist;
+  }
+
+  static float distance( RawDistance raw_dist ) { return std::sqrt(static_cast<float>(raw_dist)); };
+};
+
+typedef BinaryDescriptorTraits<32> OrbDescriptorTraits;
+// AKAZE default (full size, 3 channels) MLDB descriptor: 486 bits
+typedef BinaryDescriptorTraits<61> AkazeDescriptorTraits;
+typedef L2DescriptorTraits<128> SiftDescriptorTraits;
+
+// Brute force 2-nearest neighbors search of descriptors (one per row) with the given traits, with the same
+// semantics of hammingKnn2() (ties are won by the lowest index). The search is blocked over tiles of train
+// descriptors that fit in cache. Binary descriptors are matched with hammingKnn2(), whose SIMD kernel is
+// selected once per call (large sets of L2 descriptors are better matched with l2Knn2Gemm())
+template <class Traits>
+void bruteForceKnn2( const cv::Mat &query, const cv::Mat &train, std::vector<Knn2Match> &matches,
+                     std::vector<int> *reverse_best = nullptr )
+{
+  if constexpr ( Traits::binary )
+  {
+    hammingKnn2( query, train, matches, reverse_best );
+  }
+  else
+  {
+    typedef typename Traits::ElemType ElemType;
+    typedef typename Traits::RawDistance RawDistance;
+    CV_Assert( query.empty() || (query.type() == Traits::cv_type && query.cols == Traits::length) );
+    CV_Assert( train.empty() || (train.type() == Traits::cv_type && train.cols == Traits::length) );
+
+    const int num_query = query.rows, num_train = train.rows;
+    const int tile_size = std::max( 16, (64*1024)/Traits::bytes );
+
+    std::vector<RawDistance> best(num_query), second(num_query);
+    matches.assign( num_query, Knn2Match() );
+    std::vector<RawDistance> reverse_dist;
+    if( reverse_best )
+    {
+      reverse_best->assign( num_train, -1 );
+      reverse_dist.resize(num_train);
+    }
+
+    for( int t0 = 0; t0 < num_train; t0 += tile_size )
+    {
+      const int t1 = std::min(t0 + tile_size, num_train);
+      for( int q = 0; q < num_query; q++ )
+      {
+        const ElemType *q_desc = query.ptr<ElemType>(q);
+        Knn2Match &m = matches[q];
+        for( int t = t0; t < t1; t++ )
+        {
+          RawDistance dist = Traits::rawDistance( q_desc, train.ptr<ElemType>(t) );
+          // Train descriptors are visited by increasing index: strict comparisons keep the lowest index
+          if( m.best_idx < 0 || dist < best[q] )
+          {
+            m.second_idx = m.best_idx;
+            second[q] = best[q];
+            m.best_idx = t;
+            best[q] = dist;
+          }
+          else if( m.second_idx < 0 || dist < second[q] )
+          {
+            m.second_idx = t;
+            second[q] = dist;
+          }
+          if( reverse_best && ((*reverse_best)[t] < 0 || dist < reverse_dist[t]) )
+          {
+            (*reverse_best)[t] = q;
+            reverse_dist[t] = dist;
+          }
+        }
+      }
+    }
+
+    for( int q = 0; q < num_query; q++ )
+    {
+      if( matches[q].best_idx >= 0 )
+        matches[q].best_dist = Traits::distance(best[q]);
+      if( matches[q].second_idx >= 0 )
+        matches[q].second_dist = Traits::distance(second[q]);
+    }
+  }
+}
+
+// 2-nearest neighbors of some query descriptors among their own subsets of candidate train descriptors
+// (e.g., the ones compatible with a geometric model): the candidates of queries[k] are the train descriptors
+// candidates[offsets[k]], ..., candidates[offsets[k + 1] - 1], and matches[k] refers to queries[k]. Ties are
+// won by the lowest train index, as in bruteForceKnn2()
+template <class Traits>
+void candidatesKnn2( const cv::Mat &query, const std::vector<int> &queries, const cv::Mat &train,
+                     const std::vector<int> &offsets, const std::vector<int> &candidates,
+                     std::vector<Knn2Match> &matches )
+{
+  typedef typename Traits::ElemType ElemType;
+  typedef typename Traits::RawDistance RawDistance;
+
+  matches.assign( queries.size(), Knn2Match() );
+  for( size_t k = 0; k < queries.size(); k++ )
+  {
+    const ElemType *q_desc = query.ptr<ElemType>(queries[k]);
+    Knn2Match &m = matches[k];
+    RawDistance best = 0, second = 0;
+    for( int c = offsets[k]; c < offsets[k + 1]; c++ )
+    {
+      const int t = candidates[c];
+      RawDistance dist = Traits::rawDistance( q_desc, train.ptr<ElemType>(t) );
+      if( m.best_idx < 0 || dist < best || (dist == best && t < m.best_idx) )
+      {
+        m.second_idx = m.best_idx;
+        second = best;
+        m.best_idx = t;
+        best = dist;
+      }
+      else if( m.second_idx < 0 || dist < second || (dist == second && t < m.second_idx) )
+      {
+        m.second_idx = t;
+        second = dist;
+      }
+    }
+    if( m.best_idx >= 0 )
+      m.best_dist = Traits::distance(best);
+    if( m.second_idx >= 0 )
+      m.second_dist = Traits::distance(second);
+  }
+}
@@ -0,0 +1,113 @@
+#include "feature_backend.h"
+
+#include <iostream>
+
+#include "descriptor_traits.h"
+#include "l2_matcher.h"
+
+namespace
+{
+  // Maximum number of ORB features extracted from each image
+  const int orb_max_features = 30000;
+
+  // Below this number of query or train descriptors, L2 descriptors are matched without GEMM
+  const int min_gemm_descriptors = 64;
+
+  class L2PreparedDescriptors : public FeatureBackend::PreparedDescriptors
+  {
+   public:
+    explicit L2PreparedDescriptors( const cv::Mat &descriptors ) : gemm_descriptors(descriptors) {};
+    L2GemmDescriptors gemm_descriptors;
+  };
+
+  // Backend based on an OpenCV Feature2D, whose descriptors have the given traits
+  template <class Traits>
+  class Feature2DBackend : public FeatureBackend
+  {
+   public:
+
+    Feature2DBackend( const std::string &name, cv::Ptr<cv::Feature2D> feature2d ) :
+      name_(name), feature2d_(feature2d) {};
+
+    std::string name() const override { return name_; };
+
+    void detect( const cv::Mat &img, std::vector<cv::KeyPoint> &keypoints ) const override
+    {
+      feature2d_->detect(img, keypoints);
+    };
+
+    void compute( const cv::Mat &img, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors ) const override
+    {
+      feature2d_->compute(img, keypoints, descriptors);
+      // E.g., OpenCV SIFT descriptors are float but with integer values in [0, 255]: they are stored
+      // as bytes without any loss, with 1/4 of the memory (and memory bandwidth while matching)
+      if( !descriptors.empty() && descriptors.type() != Traits::cv_type )
+        descriptors.convertTo(descriptors, Traits::cv_type);
+      CV_Assert( descriptors.empty() ||
+                 (descriptors.type() == Traits::cv_type && descriptors.cols == Traits::length) );
+    };
+
+    bool binaryDescriptors() const override { return Traits::binary; };
+
+    std::shared_ptr<const PreparedDescriptors> prepare( const cv::Mat &descriptors ) const override
+    {
+      if constexpr ( Traits::binary )
+        return nullptr;
+      else
+        return std::make_shared<L2PreparedDescriptors>(descriptors);
+    };
+
+    void knn2( const cv::Mat &query, const cv::Mat &train, std::vector<Knn2Match> &matches,
+               std::vector<int> *reverse_best, const PreparedDescriptors *prepared_query,
+               const PreparedDescriptors *prepared_train ) const override
+    {
+      if( Traits::binary || query.rows < min_gemm_descriptors || train.rows < min_gemm_descriptors )
+      {
+        bruteForceKnn2<Traits>(query, train, matches, reverse_best);
+        return;
+      }
+
+      // L2 descriptors: matrix products, with the descriptors converted to float here if not provided
+      std::shared_ptr<const PreparedDescriptors> tmp_query, tmp_train;
+      if( !prepared_query )
+        prepared_query = (tmp_query = prepare(query)).get();
+      if( !prepared_train )
+        prepared_train = (tmp_train = prepare(train)).get();
+      l2Knn2Gemm( static_cast<const L2PreparedDescriptors *>(prepared_query)->gemm_descriptors,
+                  static_cast<const L2PreparedDescriptors *>(prepared_train)->gemm_descriptors,
+                  matches, reverse_best );
+    };
+
+    void candidatesKnn2( const cv::Mat &query, const std::vector<int> &queries, const cv::Mat &train,
+                         const std::vector<int> &offsets, const std::vector<int> &candidates,
+                         std::vector<Knn2Match> &matches ) const override
+    {
+      ::candidatesKnn2<Traits>( query, queries, train, offsets, candidates, matches );
+    };
+
+   private:
+
+    std::string name_;
+    cv::Ptr<cv::Feature2D> feature2d_;
+  };
+} // namespace
+
+std::shared_ptr<FeatureBackend> FeatureBackend::create( Type type )
+{
+  switch( type )
+  {
+    case ORB_FEATURES:
+      return std::make_shared< Feature2DBackend<OrbDescriptorTraits> >(
+               "ORB max_features=" + std::to_string(orb_max_features), cv::ORB::create(orb_max_features) );
+    case SIFT_FEATURES:
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 4)
+      return std::make_shared< Feature2DBackend<SiftDescriptorTraits> >( "SIFT", cv::SIFT::create() );
+#else
+      std::cerr<<"SIFT features require OpenCV >= 4.4"<<std::endl;
+      return std::shared_ptr<FeatureBackend>();
+#endif
+    case AKAZE_FEATURES:
+      return std::make_shared< Feature2DBackend<AkazeDescriptorTraits> >( "AKAZE", cv::AKAZE::create() );
+  }
+  return std::shared_ptr<FeatureBackend>();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "hamming_matcher.h"
+
+// Feature detector + descriptor used by the matcher, together with the matching functions specialized
+// for its descriptors (see descriptor_traits.h)
+class FeatureBackend
+{
+ public:
+
+  enum Type
+  {
+    ORB_FEATURES,
+    SIFT_FEATURES,
+    AKAZE_FEATURES
+  };
+
+  // Create a backend, return a null pointer if the type is not available in this OpenCV build
+  static std::shared_ptr<FeatureBackend> create( Type type );
+
+  virtual ~FeatureBackend() {}
+
+  // Name and settings of the backend (e.g., used in the feature cache keys)
+  virtual std::string name() const = 0;
+
+  // Detect the keypoints in an image
+  virtual void detect( const cv::Mat &img, std::vector<cv::KeyPoint> &keypoints ) const = 0;
+
+  // Compute the descriptors (one per row) of the given keypoints: keypoints for which a descriptor can't be
+  // computed are removed
+  virtual void compute( const cv::Mat &img, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors ) const = 0;
+
+  // True for binary descriptors (Hamming distance), false for the others (L2 distance, e.g. SIFT)
+  virtual bool binaryDescriptors() const = 0;
+
+  // Descriptors of an image prepared for repeated matches (e.g., converted once to another representation)
+  class PreparedDescriptors
+  {
+   public:
+    virtual ~PreparedDescriptors() {}
+  };
+
+  // Prepare the descriptors of an image for knn2(), return a null pointer if the backend does not use any
+  // preparation
+  virtual std::shared_ptr<const PreparedDescriptors> prepare( const cv::Mat &descriptors ) const = 0;
+
+  // Brute force 2-nearest neighbors search, same semantics of hammingKnn2(). The descriptors prepared by
+  // prepare() can be optionally provided, to avoid preparing them again
+  virtual void knn2( const cv::Mat &query, const cv::Mat &train, std::vector<Knn2Match> &matches,
+                     std::vector<int> *reverse_best = nullptr, const PreparedDescriptors *prepared_query = nullptr,
+                     const PreparedDescriptors *prepared_train = nullptr ) const = 0;
+
+  // 2-nearest neighbors of the query descriptors queries[k] among their candidate train descriptors
+  // candidates[offsets[k]], ..., candidates[offsets[k + 1] - 1], see candidatesKnn2() (one call per image pair,
+  // e.g. in guided matching)
+  virtual void candidatesKnn2( const cv::Mat &query, const std::vector<int> &queries, const cv::Mat &train,
+                               const std::vector<int> &offsets, const std::vector<int> &candidates,
+                               std::vector<Knn2Match> &matches ) const = 0;
+};
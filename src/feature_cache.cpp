@@ -0,0 +1,172 @@
+#include "feature_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <boost/filesystem.hpp>
+
+namespace
+{
+  const char feature_file_magic[8] = { 'S', 'F', 'M', 'F', 'E', 'A', 'T', '\0' };
+  const uint32_t feature_file_version = 1;
+  // Alignment of the arrays inside the file
+  const uint64_t feature_file_alignment = 64;
+
+  struct FeatureFileHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_keypoints;
+    int32_t desc_rows, desc_cols, desc_type;
+    uint32_t reserved;
+    uint64_t key;
+    uint64_t keypoints_offset, descriptors_offset, colors_offset, file_size;
+  };
+
+  struct PackedKeyPoint
+  {
+    float x, y, size, angle, response;
+    int32_t octave, class_id;
+  };
+
+  uint64_t alignOffset( uint64_t offset )
+  {
+    return (offset + feature_file_alignment - 1)/feature_file_alignment*feature_file_alignment;
+  }
+
+  bool writePadding( FILE *fptr, uint64_t &offset )
+  {
+    static const char zeros[feature_file_alignment] = {};
+    uint64_t aligned = alignOffset(offset), padding = aligned - offset;
+    offset = aligned;
+    return fwrite(zeros, 1, padding, fptr) == padding;
+  }
+} // namespace
+
+FeatureCache::FeatureCache( const std::string &cache_dir, uint64_t params_hash ) :
+  cache_dir_(cache_dir),
+  params_hash_(params_hash)
+{
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(cache_dir_, ec);
+  if( ec )
+    std::cerr<<"Can't create the feature cache directory "<<cache_dir_<<" : "<<ec.message()<<std::endl;
+}
+
+bool FeatureCache::imageKey( const std::string &image_filename, uint64_t &key ) const
+{
+  uint64_t content_hash;
+  if( !hashFileContent(image_filename, content_hash) )
+    return false;
+
+  key = hashBytes( &params_hash_, sizeof(params_hash_), content_hash );
+  return true;
+}
+
+std::string FeatureCache::entryFilename( uint64_t key ) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.feat", static_cast<unsigned long long>(key));
+  return (boost::filesystem::path(cache_dir_) / name).string();
+}
+
+bool FeatureCache::load( uint64_t key, Entry &entry ) const
+{
+  auto file = std::make_shared<MappedFile>();
+  if( !file->open(entryFilename(key)) || file->size() < sizeof(FeatureFileHeader) )
+    return false;
+
+  FeatureFileHeader header;
+  std::memcpy( &header, file->data(), sizeof(header) );
+  if( std::memcmp(header.magic, feature_file_magic, sizeof(feature_file_magic)) != 0 ||
+      header.version != feature_file_version || header.key != key || header.file_size != file->size() )
+    return false;
+
+  size_t desc_row_size = static_cast<size_t>(header.desc_cols)*CV_ELEM_SIZE(header.desc_type);
+  if( header.desc_rows < 0 ||
+      header.keypoints_offset + header.num_keypoints*sizeof(PackedKeyPoint) > file->size() ||
+      header.descriptors_offset + header.desc_rows*desc_row_size > file->size() ||
+      header.colors_offset + header.num_keypoints*sizeof(cv::Vec3b) > file->size() )
+    return false;
+
+  const PackedKeyPoint *keypoints = reinterpret_cast<const PackedKeyPoint *>(file->data() + header.keypoints_offset);
+  entry.keypoints.resize(header.num_keypoints);
+  for( uint32_t i = 0; i < header.num_keypoints; i++ )
+  {
+    const PackedKeyPoint &kp = keypoints[i];
+    entry.keypoints[i] = cv::KeyPoint( kp.x, kp.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id );
+  }
+
+  // Zero-copy descriptors
+  if( header.desc_rows > 0 )
+    entry.descriptors = cv::Mat( header.desc_rows, header.desc_cols, header.desc_type,
+                                 const_cast<uint8_t *>(file->data() + header.descriptors_offset) );
+  else
+    entry.descriptors.release();
+
+  const cv::Vec3b *colors = reinterpret_cast<const cv::Vec3b *>(file->data() + header.colors_offset);
+  entry.colors.assign( colors, colors + header.num_keypoints );
+
+  entry.file = file;
+  return true;
+}
+
+bool FeatureCache::store( uint64_t key, const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors,
+                          const std::vector<cv::Vec3b> &colors ) const
+{
+  if( colors.size() != keypoints.size() )
+    return false;
+
+  FeatureFileHeader header;
+  std::memset( &header, 0, sizeof(header) );
+  std::memcpy( header.magic, feature_file_magic, sizeof(feature_file_magic) );
+  header.version = feature_file_version;
+  header.num_keypoints = keypoints.size();
+  header.desc_rows = descriptors.rows;
+  header.desc_cols = descriptors.cols;
+  header.desc_type = descriptors.type();
+  header.key = key;
+
+  size_t desc_row_size = descriptors.cols*descriptors.elemSize();
+  header.keypoints_offset = alignOffset(sizeof(header));
+  header.descriptors_offset = alignOffset(header.keypoints_offset + keypoints.size()*sizeof(PackedKeyPoint));
+  header.colors_offset = alignOffset(header.descriptors_offset + descriptors.rows*desc_row_size);
+  header.file_size = header.colors_offset + colors.size()*sizeof(cv::Vec3b);
+
+  // Write to a temporary file, then rename it: concurrent readers never see partially written files
+  std::string filename = entryFilename(key),
+              tmp_filename = filename + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  FILE* fptr = fopen(tmp_filename.c_str(), "wb");
+
+  if (fptr == NULL) {
+    std::cerr << "Error: unable to open file " << tmp_filename << std::endl;
+    return false;
+  };
+
+  uint64_t offset = sizeof(header);
+  bool ok = fwrite(&header, sizeof(header), 1, fptr) == 1 && writePadding(fptr, offset);
+  for( size_t i = 0; ok && i < keypoints.size(); i++ )
+  {
+    const cv::KeyPoint &kp = keypoints[i];
+    PackedKeyPoint packed_kp = { kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id };
+    ok = fwrite(&packed_kp, sizeof(packed_kp), 1, fptr) == 1;
+  }
+  offset += keypoints.size()*sizeof(PackedKeyPoint);
+  ok = ok && writePadding(fptr, offset);
+  for( int r = 0; ok && r < descriptors.rows; r++ )
+    ok = fwrite(descriptors.ptr(r), 1, desc_row_size, fptr) == desc_row_size;
+  offset += descriptors.rows*desc_row_size;
+  ok = ok && writePadding(fptr, offset);
+  ok = ok && fwrite(colors.data(), sizeof(cv::Vec3b), colors.size(), fptr) == colors.size();
+
+  ok = (fclose(fptr) == 0) && ok;
+  ok = ok && std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+  if( !ok )
+  {
+    std::remove(tmp_filename.c_str());
+    std::cerr << "Error: unable to write the feature cache file " << filename << std::endl;
+  }
+  return ok;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "io_utils.h"
+
+// Persistent on-disk cache of the features extracted from the images. The features of each image are
+// stored in a flat binary file (header, then the keypoints, descriptors and colors arrays) whose name is
+// a key that combines the hash of the image content with the hash of the extraction parameters
+// (detector settings, calibration, ...): cached features are reused only if both are unchanged.
+// Files are read through mmap, and the descriptors are used in place without copying them
+class FeatureCache
+{
+ public:
+
+  // Cached features of an image. The descriptors matrix points directly into the memory mapped file, that
+  // stays mapped as long as file is alive (the mapping is read only: the descriptors must not be modified)
+  struct Entry
+  {
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    std::vector<cv::Vec3b> colors;
+    std::shared_ptr<MappedFile> file;
+  };
+
+  // Use (creating it if needed) the cache_dir directory. params_hash is an hash of all the parameters that
+  // affect the extracted features
+  FeatureCache( const std::string &cache_dir, uint64_t params_hash );
+
+  // Compute the cache key of an image, return false if the image file can't be read
+  bool imageKey( const std::string &image_filename, uint64_t &key ) const;
+
+  // Load the features with the given key, return false if they are not in the cache
+  bool load( uint64_t key, Entry &entry ) const;
+
+  // Store the features with the given key, return false on failure. It can be called from multiple threads
+  bool store( uint64_t key, const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors,
+              const std::vector<cv::Vec3b> &colors ) const;
+
+ private:
+
+  std::string entryFilename( uint64_t key ) const;
+
+  std::string cache_dir_;
+  uint64_t params_hash_;
+};
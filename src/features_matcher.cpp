@@ -1,7 +1,128 @@
 #include "features_matcher.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <future>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <boost/filesystem.hpp>
+
+#include "descriptor_spill.h"
+#include "feature_cache.h"
+#include "hamming_matcher.h"
+#include "parallel_utils.h"
+#include "vocabulary_tree.h"
+
+namespace
+{
+  // Robust estimator used for the geometric verification: with OpenCV >= 4.5.1, USAC with PROSAC sampling
+  // (the matches are sorted by descriptor distance, i.e., by quality) and SPRT early rejection of the bad
+  // models, plain RANSAC otherwise
+#if CV_VERSION_MAJOR > 4 || \
+    (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 1)))
+  const int verification_method = cv::USAC_PROSAC;
+#else
+  const int verification_method = cv::RANSAC;
+#endif
+
+  // Number of images of the tiles matched by each task, with backends that prepare the descriptors
+  const int matching_tile_images = 4;
+
+  // Minimum number of images cached while exporting the matches images
+  const int export_min_cached_images = 8;
+
+  // Side (in pixels) of the cells of the grids used by the guided matching
+  const float guided_matching_cell_size = 16.0f;
+
+  // Uniform grid over a set of keypoints, in compressed form: the keypoints inside the cell (x, y) are
+  // indices[offsets[y*cols + x], offsets[y*cols + x + 1])
+  struct KeypointsGrid
+  {
+    float x0 = 0, y0 = 0;
+    int cols = 0, rows = 0;
+    std::vector<int> offsets, indices;
+
+    explicit KeypointsGrid( const KeypointsStore &kps )
+    {
+      if( kps.empty() )
+        return;
+      const int num_kps = kps.size();
+      const float *xs = kps.x(), *ys = kps.y();
+      float x1 = x0 = xs[0], y1 = y0 = ys[0];
+      for( int k = 0; k < num_kps; k++ )
+      {
+        x0 = std::min(x0, xs[k]); x1 = std::max(x1, xs[k]);
+        y0 = std::min(y0, ys[k]); y1 = std::max(y1, ys[k]);
+      }
+      cols = static_cast<int>((x1 - x0)/guided_matching_cell_size) + 1;
+      rows = static_cast<int>((y1 - y0)/guided_matching_cell_size) + 1;
+
+      std::vector<int> kps_cell(num_kps);
+      offsets.assign(cols*rows + 1, 0);
+      for( int k = 0; k < num_kps; k++ )
+      {
+        kps_cell[k] = cellY(ys[k])*cols + cellX(xs[k]);
+        offsets[kps_cell[k] + 1]++;
+      }
+      for( int c = 0; c < cols*rows; c++ )
+        offsets[c + 1] += offsets[c];
+      indices.resize(num_kps);
+      std::vector<int> cells_pos(offsets.begin(), offsets.end() - 1);
+      for( int k = 0; k < num_kps; k++ )
+        indices[cells_pos[kps_cell[k]]++] = k;
+    }
+
+    // Cell coordinates (-1 or cols/rows for the points outside the grid)
+    int cellX( double x ) const
+    {
+      return static_cast<int>(std::min(std::max(std::floor((x - x0)/guided_matching_cell_size), -1.0), double(cols)));
+    };
+    int cellY( double y ) const
+    {
+      return static_cast<int>(std::min(std::max(std::floor((y - y0)/guided_matching_cell_size), -1.0), double(rows)));
+    };
+
+    // Call f(idx) for every keypoint inside the cells [cx0, cx1] x [cy0, cy1] (clamped to the grid)
+    template <typename F> void forEach( int cx0, int cx1, int cy0, int cy1, F f ) const
+    {
+      cx0 = std::max(cx0, 0); cx1 = std::min(cx1, cols - 1);
+      cy0 = std::max(cy0, 0); cy1 = std::min(cy1, rows - 1);
+      if( cx0 > cx1 )
+        return;
+      // The cells [cx0, cx1] of a row are contiguous
+      for( int cy = cy0; cy <= cy1; cy++ )
+        for( int k = offsets[cy*cols + cx0]; k < offsets[cy*cols + cx1 + 1]; k++ )
+          f(indices[k]);
+    }
+  };
+
+  // Keep the nearest neighbors matches that pass the ratio test and, if reverse_best is not null, the
+  // cross-check. num_raw_matches is increased by the number of queries with a nearest neighbor
+  void filterKnnMatches( const std::vector<Knn2Match> &knn_matches, const std::vector<int> *reverse_best,
+                         float max_ratio, std::vector<cv::DMatch> &matches, int &num_raw_matches )
+  {
+    matches.reserve(knn_matches.size());
+    for( int k = 0; k < static_cast<int>(knn_matches.size()); k++ )
+    {
+      const Knn2Match &m = knn_matches[k];
+      if( m.best_idx < 0 )
+        continue;
+      num_raw_matches++;
+      if( ( max_ratio >= 1.0f || m.second_idx < 0 || m.best_dist < max_ratio*m.second_dist ) &&
+          ( !reverse_best || (*reverse_best)[m.best_idx] == k ) )
+        matches.emplace_back(k, m.best_idx, m.best_dist);
+    }
+  }
+
+  double elapsedMs( std::chrono::steady_clock::time_point start )
+  {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+} // namespace
 
 FeatureMatcher::FeatureMatcher(cv::Mat intrinsics_matrix, cv::Mat dist_coeffs, double focal_scale)
 {
@@ -10,153 +131,1085 @@ FeatureMatcher::FeatureMatcher(cv::Mat intrinsics_matrix, cv::Mat dist_coeffs, d
   new_intrinsics_matrix_ = intrinsics_matrix.clone();
   new_intrinsics_matrix_.at<double>(0,0) *= focal_scale;
   new_intrinsics_matrix_.at<double>(1,1) *= focal_scale;
+  undistorter_ = std::make_shared<ImageUndistorter>(intrinsics_matrix_, dist_coeffs_, new_intrinsics_matrix_);
+  feature_backend_ = FeatureBackend::create(FeatureBackend::ORB_FEATURES);
 }
 
-cv::Mat FeatureMatcher::readUndistortedImage(const std::string& filename )
+bool FeatureMatcher::setFeatureBackend( FeatureBackend::Type type )
 {
-  cv::Mat img = cv::imread(filename), und_img, dbg_img;
-  cv::undistort	(	img, und_img, intrinsics_matrix_, dist_coeffs_, new_intrinsics_matrix_ );
+  std::shared_ptr<FeatureBackend> backend = FeatureBackend::create(type);
+  if( !backend )
+    return false;
+  feature_backend_ = backend;
+  return true;
+}
 
-  return und_img;
+cv::Mat FeatureMatcher::readUndistortedImage(const std::string& filename )
+{
+  return undistorter_->undistort(cv::imread(filename));
 }
 
 void FeatureMatcher::extractFeatures()
 {
-  features_.resize(images_names_.size());
+  if( descriptor_matching_ == LSH_MATCHING && !feature_backend_->binaryDescriptors() )
+  {
+    std::cerr<<"LSH matching requires binary descriptors, using brute force matching"<<std::endl;
+    descriptor_matching_ = BRUTE_FORCE_MATCHING;
+  }
+
+  features_.assign(images_names_.size(), std::vector<cv::KeyPoint>());
+  feats_colors_.assign(images_names_.size(), std::vector<cv::Vec3b>());
+  keypoints_.assign(images_names_.size(), KeypointsStore());
+  coarse_indices_.assign(images_names_.size(), std::vector<int>());
   descriptors_.resize(images_names_.size());
-  feats_colors_.resize(images_names_.size());
-
-  for( int i = 0; i < images_names_.size(); i++  )
-  {
-    std::cout<<"Computing descriptors for image "<<i<<std::endl;
-    cv::Mat img = readUndistortedImage(images_names_[i]);
-
-    //////////////////////////// Code to be completed (1/7) /////////////////////////////////
-    // Extract salient points + descriptors from i-th image, and store them into
-    // features_[i] and descriptors_[i] vector, respectively
-    // Extract also the color (i.e., the cv::Vec3b information) of each feature, and store
-    // it into feats_colors_[i] vector
-    /////////////////////////////////////////////////////////////////////////////////////////
-    cv::Ptr<cv::ORB> orb = cv::ORB::create();
-    orb->setMaxFeatures(30000);
-    
-    // Detect keypoints
-    orb->detect(img, features_[i]);
-
-    // Compute descriptors
-    orb->compute(img, features_[i], descriptors_[i]);
-    feats_colors_[i].resize(features_[i].size());
-
-    // Same using SIFT
-    //cv::Ptr<cv::SIFT> sift = cv::SIFT::create();
-    //sift->detect(img, features_[i]);
-    //sift->compute(img, features_[i], descriptors_[i]);
-    //feats_colors_[i].resize(features_[i].size());
-    
-    // Same using SURF
-    //cv::Ptr<cv::SURF> surf = cv::SURF::create();
-    //surf->detect(img, features_[i]);
-    //surf->compute(img, features_[i], descriptors_[i]);
-    //feats_colors_[i].resize(features_[i].size());
-
-    for(int j = 0; j < features_[i].size(); j++) {
-      // Get the color of the feature
-      cv::Point2f pt = features_[i][j].pt;
-      cv::Vec3b color = img.at<cv::Vec3b>(cv::Point2i(pt.x, pt.y));
-      feats_colors_[i][j] = color;
-    }
-    /////////////////////////////////////////////////////////////////////////////////////////
+  features_released_ = false;
+  lsh_indices_.clear();
+  lsh_indices_.resize( descriptor_matching_ == LSH_MATCHING ? images_names_.size() : 0 );
+  features_files_.assign( images_names_.size(), nullptr );
+
+  std::unique_ptr<FeatureCache> cache;
+  if( !feature_cache_dir_.empty() )
+    cache.reset( new FeatureCache(feature_cache_dir_, extractionParamsHash()) );
+
+  // With a memory budget, the extracted descriptors are moved to the spill file (the ones loaded from the
+  // feature cache are already memory mapped)
+  std::unique_ptr<DescriptorSpill> spill;
+  if( memory_budget_ )
+  {
+    spill.reset( new DescriptorSpill() );
+    if( !spill->create(spill_dir_) )
+    {
+      std::cerr<<"Descriptors are kept in memory"<<std::endl;
+      spill.reset();
+    }
+  }
+  std::vector<char> spilled(images_names_.size(), 0);
+
+  int num_images = images_names_.size(),
+      num_workers = std::min( resolveNumThreads(num_threads_), std::max(num_images, 1) ),
+      num_decoders = std::max( 1, num_workers/4 );
+
+  struct DecodedImage
+  {
+    int idx;
+    cv::Mat img;
+    bool cacheable;
+    uint64_t cache_key;
+  };
+
+  // Decoded images waiting to be processed: the queue is bounded so that at most a few full resolution
+  // images per worker are kept in memory, whatever the number of images
+  BoundedQueue<DecodedImage> decoded_queue( 2*num_workers );
+  std::atomic<int> next_image(0), active_decoders(num_decoders);
+  std::mutex log_mutex;
+
+  auto decoder = [&]()
+  {
+    for( int i = next_image++; i < num_images; i = next_image++ )
+    {
+      DecodedImage item = { i, cv::Mat(), false, 0 };
+      if( cache && cache->imageKey(images_names_[i], item.cache_key) )
+      {
+        item.cacheable = true;
+        FeatureCache::Entry entry;
+        if( cache->load(item.cache_key, entry) )
+        {
+          // Cache hit: no need to decode the image
+          features_[i].swap(entry.keypoints);
+          descriptors_[i] = entry.descriptors;
+          feats_colors_[i].swap(entry.colors);
+          features_files_[i] = entry.file;
+          storeImageKeypoints(i);
+          if( descriptor_matching_ == LSH_MATCHING )
+            lsh_indices_[i].build( descriptors_[i], lsh_params_ );
+
+          std::lock_guard<std::mutex> lock(log_mutex);
+          std::cout<<"Loaded descriptors for image "<<i<<" from the feature cache"<<std::endl;
+          continue;
+        }
+      }
+
+      item.img = cv::imread(images_names_[i]);
+      if( item.img.empty() )
+      {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cerr<<"Can't read image "<<images_names_[i]<<", skipping it"<<std::endl;
+      }
+      decoded_queue.push(item);
+    }
+    if( --active_decoders == 0 )
+      decoded_queue.close();
+  };
+
+  auto worker = [&]()
+  {
+    DecodedImage item;
+    while( decoded_queue.pop(item) )
+    {
+      {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cout<<"Computing descriptors for image "<<item.idx<<std::endl;
+      }
+      features_[item.idx].clear();
+      feats_colors_[item.idx].clear();
+      descriptors_[item.idx].release();
+      if( item.img.empty() )
+      {
+        keypoints_[item.idx].clear();
+        continue;
+      }
+
+      if( undistortion_mode_ == UNDISTORT_IMAGE )
+      {
+        extractImageFeatures( item.idx, undistorter_->undistort(item.img) );
+      }
+      else
+      {
+        extractImageFeatures( item.idx, item.img );
+        undistortKeypoints( item.idx );
+      }
+
+      if( item.cacheable )
+        cache->store( item.cache_key, features_[item.idx], descriptors_[item.idx], feats_colors_[item.idx] );
+      storeImageKeypoints(item.idx);
+
+      if( spill && spill->append(item.idx, descriptors_[item.idx]) )
+      {
+        descriptors_[item.idx].release();
+        spilled[item.idx] = 1;
+      }
+      else if( descriptor_matching_ == LSH_MATCHING )
+      {
+        lsh_indices_[item.idx].build( descriptors_[item.idx], lsh_params_ );
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for( int i = 0; i < num_decoders; i++ )
+    threads.emplace_back(decoder);
+  for( int i = 0; i < num_workers; i++ )
+    threads.emplace_back(worker);
+  for( auto &t : threads )
+    t.join();
+
+  if( spill && std::find(spilled.begin(), spilled.end(), 1) != spilled.end() )
+  {
+    if( !spill->map(descriptors_, features_files_) )
+      std::cerr<<"Some spilled descriptors are lost, their images will not be matched"<<std::endl;
+    // The LSH indices refer to the descriptors, they are built on the mapped ones
+    if( descriptor_matching_ == LSH_MATCHING )
+    {
+      WorkStealingPool pool(num_threads_);
+      for( int i = 0; i < num_images; i++ )
+        if( spilled[i] )
+          pool.submit([&, i](){ lsh_indices_[i].build( descriptors_[i], lsh_params_ ); });
+      pool.wait();
+    }
+  }
+}
+
+uint64_t FeatureMatcher::extractionParamsHash() const
+{
+  // Everything that changes the extracted features should be included here
+  std::string detector = feature_backend_->name() +
+                         " selection=" + std::to_string(keypoints_selection_.max_keypoints) + "," +
+                         std::to_string(keypoints_selection_.grid_cols) + "x" +
+                         std::to_string(keypoints_selection_.grid_rows) + "," +
+                         std::to_string(keypoints_selection_.max_keypoints_per_cell);
+  uint64_t hash = hashBytes( detector.data(), detector.size() );
+  hash = hashBytes( &undistortion_mode_, sizeof(undistortion_mode_), hash );
+  for( const cv::Mat &m : { intrinsics_matrix_, dist_coeffs_, new_intrinsics_matrix_ } )
+  {
+    cv::Mat m_d;
+    m.convertTo(m_d, CV_64F);
+    hash = hashBytes( m_d.data, m_d.total()*m_d.elemSize(), hash );
+  }
+  return hash;
+}
+
+void FeatureMatcher::extractImageFeatures( int i, const cv::Mat &img )
+{
+  //////////////////////////// Code to be completed (1/7) /////////////////////////////////
+  // Extract salient points + descriptors from i-th image, and store them into
+  // features_[i] and descriptors_[i] vector, respectively
+  // Extract also the color (i.e., the cv::Vec3b information) of each feature, and store
+  // it into feats_colors_[i] vector
+  /////////////////////////////////////////////////////////////////////////////////////////
+  // Detect keypoints, then possibly keep only the strongest ones evenly distributed over the image
+  feature_backend_->detect(img, features_[i]);
+  selectKeypoints(features_[i], img.size(), keypoints_selection_);
+
+  // Compute descriptors
+  feature_backend_->compute(img, features_[i], descriptors_[i]);
+  feats_colors_[i].resize(features_[i].size());
+
+  for(int j = 0; j < features_[i].size(); j++) {
+    // Get the color of the feature
+    cv::Point2f pt = features_[i][j].pt;
+    cv::Vec3b color = img.at<cv::Vec3b>(cv::Point2i(pt.x, pt.y));
+    feats_colors_[i][j] = color;
+  }
+  /////////////////////////////////////////////////////////////////////////////////////////
+}
+
+void FeatureMatcher::undistortKeypoints( int i )
+{
+  auto &features = features_[i];
+  std::vector<cv::Point2f> pts(features.size());
+  for( size_t j = 0; j < features.size(); j++ )
+    pts[j] = features[j].pt;
+
+  undistorter_->undistortPoints(pts);
+
+  for( size_t j = 0; j < features.size(); j++ )
+    features[j].pt = pts[j];
+}
+
+void FeatureMatcher::storeImageKeypoints( int i )
+{
+  // The strongest keypoints for the coarse verification are selected here, while the responses are available
+  std::vector<int> &coarse_indices = coarse_indices_[i];
+  coarse_indices.clear();
+  const std::vector<cv::KeyPoint> &kps = features_[i];
+  const int num_coarse = verification_params_.coarse_keypoints;
+  if( num_coarse > 0 )
+  {
+    coarse_indices.resize(kps.size());
+    for( size_t k = 0; k < kps.size(); k++ )
+      coarse_indices[k] = static_cast<int>(k);
+    // Strongest first, ties broken by index so that the selection is deterministic
+    if( static_cast<int>(coarse_indices.size()) > num_coarse )
+    {
+      std::partial_sort( coarse_indices.begin(), coarse_indices.begin() + num_coarse, coarse_indices.end(),
+                         [&]( int k0, int k1 )
+                         {
+                           return kps[k0].response > kps[k1].response ||
+                                  (kps[k0].response == kps[k1].response && k0 < k1);
+                         });
+      coarse_indices.resize(num_coarse);
+    }
   }
+
+  keypoints_[i].assign( features_[i], feats_colors_[i] );
+  std::vector<cv::KeyPoint>().swap(features_[i]);
+  std::vector<cv::Vec3b>().swap(feats_colors_[i]);
+}
+
+void FeatureMatcher::releaseImageFeatures( int i )
+{
+  if( features_files_[i] && !descriptors_[i].empty() )
+    features_files_[i]->advise( descriptors_[i].data, descriptors_[i].total()*descriptors_[i].elemSize(), false );
+  descriptors_[i].release();
+  features_files_[i].reset();
+  if( i < static_cast<int>(lsh_indices_.size()) )
+    lsh_indices_[i].clear();
+  if( i < static_cast<int>(coarse_descriptors_.size()) )
+    coarse_descriptors_[i].release();
+  std::vector<int>().swap(coarse_indices_[i]);
+
+  // Only the matched keypoints can be observations of the tracks
+  std::vector<char> matched;
+  track_builder_.matchedFeatures(i, matched);
+  keypoints_[i].retain(matched);
 }
 
 void FeatureMatcher::exhaustiveMatching()
 {
-  std::vector<cv::DMatch> matches, inlier_matches;
-  
-  for( int i = 0; i < images_names_.size() - 1; i++ )
+  std::vector< std::pair<int, int> > pairs;
+  for( int i = 0; i < static_cast<int>(images_names_.size()) - 1; i++ )
   {
     for( int j = i + 1; j < images_names_.size(); j++ )
+      pairs.emplace_back(i, j);
+  }
+
+  matchImagePairs(pairs);
+}
+
+void FeatureMatcher::sequentialMatching( int window_size, int loop_stride )
+{
+  int num_images = images_names_.size();
+  std::vector< std::pair<int, int> > pairs;
+  for( int i = 0; i < num_images - 1; i++ )
+  {
+    for( int j = i + 1; j < num_images && j <= i + window_size; j++ )
+      pairs.emplace_back(i, j);
+
+    if( loop_stride > 0 && i % loop_stride == 0 )
+    {
+      int j = i + window_size + 1;
+      j += (loop_stride - j % loop_stride) % loop_stride;
+      for( ; j < num_images; j += loop_stride )
+        pairs.emplace_back(i, j);
+    }
+  }
+  // Window and loop closure pairs, in the same order as exhaustiveMatching()
+  std::sort(pairs.begin(), pairs.end());
+
+  std::cout<<"Matching "<<pairs.size()<<" sequential image pairs"<<std::endl;
+  matchImagePairs(pairs);
+}
+
+void FeatureMatcher::retrievalMatching( int num_neighbors )
+{
+  if( !feature_backend_->binaryDescriptors() )
+  {
+    std::cerr<<"Retrieval matching requires binary descriptors, using exhaustive matching"<<std::endl;
+    exhaustiveMatching();
+    return;
+  }
+
+  int desc_bytes = 0;
+  for( auto &d : descriptors_ )
+    desc_bytes = std::max( desc_bytes, d.cols );
+
+  // An existing vocabulary file is never overwritten: if it can not be used, the vocabulary is trained
+  // in memory only
+  VocabularyTree vocabulary;
+  bool save_vocabulary = !vocabulary_filename_.empty() && !boost::filesystem::exists(vocabulary_filename_);
+  bool loaded = false;
+  if( !vocabulary_filename_.empty() && !save_vocabulary && vocabulary.load(vocabulary_filename_) )
+  {
+    if( vocabulary.descriptorBytes() == desc_bytes )
+      loaded = true;
+    else
+      std::cerr<<"Error: the vocabulary "<<vocabulary_filename_<<" is for "<<vocabulary.descriptorBytes()
+               <<" bytes descriptors, the features have "<<desc_bytes<<" bytes descriptors"<<std::endl;
+  }
+
+  if( loaded )
+  {
+    std::cout<<"Vocabulary with "<<vocabulary.numWords()<<" words loaded from "<<vocabulary_filename_<<std::endl;
+  }
+  else
+  {
+    if( !vocabulary_filename_.empty() && !save_vocabulary )
+      std::cerr<<"The vocabulary file "<<vocabulary_filename_<<" is left unchanged, training a new vocabulary"
+               <<" without saving it"<<std::endl;
+    vocabulary.train( descriptors_, vocabulary_branching_, vocabulary_depth_ );
+    if( save_vocabulary && vocabulary.save(vocabulary_filename_) )
+      std::cout<<"Vocabulary saved to "<<vocabulary_filename_<<std::endl;
+  }
+
+  int num_images = images_names_.size();
+  std::vector<BowVector> bows(num_images);
+  {
+    WorkStealingPool pool(num_threads_);
+    for( int i = 0; i < num_images; i++ )
+      pool.submit([&, i](){ vocabulary.transform(descriptors_[i], bows[i]); });
+    pool.wait();
+  }
+
+  ImageDatabase database(vocabulary.numWords());
+  for( int i = 0; i < num_images; i++ )
+    database.add(bows[i]);
+
+  // Candidate pairs, each one taken once (i < j) and sorted so that the results do not depend on the
+  // queries order
+  std::vector< std::pair<int, int> > pairs;
+  std::vector< std::pair<int, float> > results;
+  for( int i = 0; i < num_images; i++ )
+  {
+    database.query( bows[i], num_neighbors, results, i );
+    for( auto &r : results )
+      pairs.emplace_back( std::min(i, r.first), std::max(i, r.first) );
+  }
+  std::sort(pairs.begin(), pairs.end());
+  pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+  std::cout<<"Retrieved "<<pairs.size()<<" candidate image pairs"<<std::endl;
+  matchImagePairs(pairs);
+}
+
+void FeatureMatcher::matchImagePairs( const std::vector< std::pair<int, int> > &pairs )
+{
+  if( features_released_ )
+  {
+    std::cerr<<"The features have been released by a previous matching, extract them again"<<std::endl;
+    return;
+  }
+
+  std::cout<<"Features : "<<feature_backend_->name();
+  if( feature_backend_->binaryDescriptors() )
+    std::cout<<", Hamming distance kernel : "<<hammingKernelName();
+  std::cout<<std::endl;
+
+  if( verification_params_.coarse_keypoints > 0 )
+    prepareCoarseFeatures();
+
+  // Each matching builds its tracks from scratch, on the keypoints of the last extraction
+  std::vector<int> num_features(keypoints_.size());
+  for( size_t i = 0; i < keypoints_.size(); i++ )
+    num_features[i] = keypoints_[i].size();
+  track_builder_.init(num_features);
+
+  // Last pair of each image, after which the data used only for the matching (e.g., the descriptors and the
+  // unmatched keypoints) is released
+  const int num_images = static_cast<int>(keypoints_.size());
+  std::vector<size_t> images_last_pair(num_images, pairs.size());
+  for( size_t k = 0; k < pairs.size(); k++ )
+    images_last_pair[pairs[k].first] = images_last_pair[pairs[k].second] = k;
+
+  // Pairs are matched in any order by the pool workers, while their results are merged strictly following
+  // the pairs order (each completed pair waits in pairs_inliers until all the previous ones have been merged),
+  // so that the log is the same of a single-threaded run. The tracks do not depend on the merge order
+  std::vector< std::vector<cv::DMatch> > pairs_inliers(pairs.size());
+  std::vector<PairStats> pairs_stats(pairs.size());
+  std::vector<char> pair_done(pairs.size(), 0);
+  size_t next_pair_to_merge = 0;
+  std::mutex merge_mutex;
+
+  auto mergeCompletedPair = [&]( size_t k )
+  {
+    std::lock_guard<std::mutex> lock(merge_mutex);
+    pair_done[k] = 1;
+    for( ; next_pair_to_merge < pairs.size() && pair_done[next_pair_to_merge]; next_pair_to_merge++ )
     {
-      std::cout<<"Matching image "<<i<<" with image "<<j<<std::endl;
-
-      //////////////////////////// Code to be completed (2/7) /////////////////////////////////
-      // Match descriptors between image i and image j, and perform geometric validation,
-      // possibly discarding the outliers (remember that features have been extracted
-      // from undistorted images that now has new_intrinsics_matrix_ as K matrix and
-      // no distortions)
-      // As geometric models, use both the Essential matrix and the Homograph matrix,
-      // both by setting new_intrinsics_matrix_ as K matrix.
-      // As threshold in the functions to estimate both models, you may use 1.0 or similar.
-      // Store inlier matches into the inlier_matches vector
-      // Do not set matches between two images if the amount of inliers matches
-      // (i.e., geomatrically verified matches) is small (say <= 5 matches)
-      // In case of success, set the matches with the function:
-      // setMatches( i, j, inlier_matches);
-      /////////////////////////////////////////////////////////////////////////////////////////
-      // Use the BFMatcher to match descriptor
-      // For ORB use the Hamming distance
-      cv::BFMatcher matcher(cv::NORM_HAMMING);
-      // For SIFT/SURF use the L2 distance
-      //cv::BFMatcher matcher(cv::NORM_L2);
-      matcher.match(descriptors_[i], descriptors_[j], matches);
-
-      // Prepare the points for the essential matrix
-      std::vector<cv::Point2f> pts0, pts1;
-      for (const auto &match : matches) {
-        pts0.push_back(features_[i][match.queryIdx].pt);
-        pts1.push_back(features_[j][match.trainIdx].pt);
+      int i = pairs[next_pair_to_merge].first, j = pairs[next_pair_to_merge].second;
+      auto &inlier_matches = pairs_inliers[next_pair_to_merge];
+      const PairStats &stats = pairs_stats[next_pair_to_merge];
+
+      if( stats.coarse_rejected )
+      {
+        std::cout<<"Matching image "<<i<<" with image "<<j<<" : discarded by the coarse verification, "
+                 <<stats.num_coarse_inliers<<" inliers ("<<stats.coarse_ms<<" ms)"<<std::endl;
+      }
+      else
+      {
+        std::cout<<"Matching image "<<i<<" with image "<<j<<" : "<<stats.num_raw_matches<<" matches, "
+                 <<stats.num_filtered_matches<<" after filtering, inliers E "<<stats.num_inliers_E<<" H "
+                 <<stats.num_inliers_H<<", guided "<<stats.num_guided_matches<<" ("<<stats.matching_ms
+                 <<" ms matching, "<<stats.verification_ms<<" ms verification)"<<std::endl;
+        if (inlier_matches.size() > 5) {
+          std::cout << "Found " << inlier_matches.size() << " inliers" << std::endl;
+          // Set the matches
+          setMatches(i, j, inlier_matches);
+        } else {
+          std::cerr << "Not enough inliers matches" << std::endl;
+        }
       }
+      std::vector<cv::DMatch>().swap(inlier_matches);
+
+      // All the pairs of an image are merged only after they have been matched: after its last pair, the
+      // image is not used anymore
+      for( int img : { i, j } )
+        if( images_last_pair[img] == next_pair_to_merge )
+          releaseImageFeatures(img);
+    }
+  };
 
-      // Estimate the essential matrix with mask output
-      std::vector<uchar> mask_E;
-      cv::Mat E = cv::findEssentialMat(pts0, pts1, new_intrinsics_matrix_, cv::RANSAC, 0.999, 1.0, mask_E);
-
-      // Estimate the homography matrix with mask output
-      std::vector<uchar> mask_H;
-      cv::Mat H = cv::findHomography(pts0, pts1, cv::RANSAC, 1.0, mask_H);
-      
-      // Count inliers for both models
-      int num_inliers_E = cv::countNonZero(mask_E);
-      int num_inliers_H = (!H.empty()) ? cv::countNonZero(mask_H) : 0;
-      
-      // Choose the mask with more inliers
-      std::vector<uchar>& best_mask = (num_inliers_E > num_inliers_H) ? mask_E : mask_H;
-      
-      // Get inlier matches based on the best mask
-      inlier_matches.clear();
-      for (size_t k = 0; k < best_mask.size(); k++) {
-        if (best_mask[k]) {
-          inlier_matches.push_back(matches[k]);
+  WorkStealingPool pool(num_threads_);
+  if( memory_budget_ )
+  {
+    // Out-of-core matching: the steps are matched one at a time, each one in parallel
+    std::vector<MatchingStep> steps = outOfCoreMatchingSteps(pairs);
+    std::cout<<"Out-of-core matching in "<<steps.size()<<" steps (memory budget "<<memory_budget_/(1024*1024)
+             <<" MB)"<<std::endl;
+
+    auto adviseDescriptors = [&]( int i, bool will_need )
+    {
+      if( features_files_[i] && !descriptors_[i].empty() )
+        features_files_[i]->advise( descriptors_[i].data, descriptors_[i].total()*descriptors_[i].elemSize(),
+                                    will_need );
+    };
+
+    std::vector< std::shared_ptr<const FeatureBackend::PreparedDescriptors> > prepared(num_images);
+    std::vector<char> in_step(num_images, 0), in_next_step(num_images, 0);
+    if( !steps.empty() )
+      for( int i : steps[0].images )
+        adviseDescriptors(i, true);
+    for( size_t s = 0; s < steps.size(); s++ )
+    {
+      const MatchingStep &step = steps[s];
+      std::fill(in_step.begin(), in_step.end(), 0);
+      std::fill(in_next_step.begin(), in_next_step.end(), 0);
+      for( int i : step.images )
+        in_step[i] = 1;
+      // Read ahead the descriptors of the next step while this one is matched
+      if( s + 1 < steps.size() )
+      {
+        for( int i : steps[s + 1].images )
+        {
+          in_next_step[i] = 1;
+          if( !in_step[i] )
+            adviseDescriptors(i, true);
+        }
+      }
+
+      // The descriptors of each image are prepared once for all the consecutive steps that include it
+      for( int i : step.images )
+        if( !feature_backend_->binaryDescriptors() && !prepared[i] )
+          pool.submit([&, i](){ prepared[i] = feature_backend_->prepare(descriptors_[i]); });
+      pool.wait();
+
+      bool concurrent_models = step.pairs.size() < static_cast<size_t>(pool.numThreads());
+      for( size_t k : step.pairs )
+      {
+        pool.submit([&, k, concurrent_models]()
+        {
+          int i = pairs[k].first, j = pairs[k].second;
+          matchImagePair( i, j, pairs_inliers[k], pairs_stats[k], concurrent_models,
+                          prepared[i].get(), prepared[j].get() );
+          mergeCompletedPair(k);
+        });
+      }
+      pool.wait();
+
+      for( int i : step.images )
+      {
+        if( !in_next_step[i] )
+        {
+          prepared[i].reset();
+          adviseDescriptors(i, false);
         }
       }
-      
-      if (inlier_matches.size() > 5) {
-        std::cout << "Found " << inlier_matches.size() << " inliers" << std::endl;
-        // Set the matches
-        setMatches(i, j, inlier_matches);
-      } else {
-        std::cerr << "Not enough inliers matches" << std::endl;
+    }
+  }
+  else
+  {
+    // Each task matches a group of pairs. Backends that prepare the descriptors (e.g., SIFT, converted to float
+    // for the matrix products) match tiles of images against tiles of images: each task takes the pairs
+    // between two tiles, and prepares the descriptors of their images only once. Otherwise, one task per pair
+    std::vector< std::vector<size_t> > tasks_pairs;
+    if( feature_backend_->binaryDescriptors() )
+    {
+      tasks_pairs.resize(pairs.size());
+      for( size_t k = 0; k < pairs.size(); k++ )
+        tasks_pairs[k].push_back(k);
+    }
+    else
+    {
+      std::map< std::pair<int, int>, size_t > tiles_task;
+      for( size_t k = 0; k < pairs.size(); k++ )
+      {
+        auto tiles = std::make_pair( pairs[k].first/matching_tile_images, pairs[k].second/matching_tile_images );
+        auto it = tiles_task.find(tiles);
+        if( it == tiles_task.end() )
+        {
+          it = tiles_task.emplace(tiles, tasks_pairs.size()).first;
+          tasks_pairs.emplace_back();
+        }
+        tasks_pairs[it->second].push_back(k);
       }
-      /////////////////////////////////////////////////////////////////////////////////////////
+    }
 
+    // With fewer pairs than threads, the cores are better used by estimating the two models of a pair in parallel
+    bool concurrent_models = tasks_pairs.size() < static_cast<size_t>(pool.numThreads());
+    for( size_t t = 0; t < tasks_pairs.size(); t++ )
+    {
+      pool.submit([&, t]()
+      {
+        std::map< int, std::shared_ptr<const FeatureBackend::PreparedDescriptors> > prepared;
+        auto preparedDescriptors = [&]( int i )
+        {
+          auto it = prepared.find(i);
+          if( it == prepared.end() )
+            it = prepared.emplace(i, feature_backend_->prepare(descriptors_[i])).first;
+          return it->second.get();
+        };
+
+        for( size_t k : tasks_pairs[t] )
+        {
+          int i = pairs[k].first, j = pairs[k].second;
+          if( feature_backend_->binaryDescriptors() )
+            matchImagePair( i, j, pairs_inliers[k], pairs_stats[k], concurrent_models );
+          else
+            matchImagePair( i, j, pairs_inliers[k], pairs_stats[k], concurrent_models,
+                            preparedDescriptors(i), preparedDescriptors(j) );
+          mergeCompletedPair(k);
+        }
+      });
+    }
+    pool.wait();
+  }
+
+  // Summary of the verification
+  int num_verified = 0, num_discarded_early = 0, num_E_models = 0;
+  int num_coarse_verified = 0, num_coarse_passed = 0, num_coarse_rejected = 0, num_fine = 0;
+  double matching_ms = 0, verification_ms = 0, coarse_ms = 0;
+  for( auto &stats : pairs_stats )
+  {
+    coarse_ms += stats.coarse_ms;
+    if( stats.coarse_rejected )
+    {
+      num_coarse_verified++;
+      num_coarse_rejected++;
+      continue;
+    }
+    if( stats.coarse_verified )
+    {
+      num_coarse_verified++;
+      num_coarse_passed++;
+    }
+    num_fine++;
+    matching_ms += stats.matching_ms;
+    verification_ms += stats.verification_ms;
+    if( stats.num_filtered_matches < std::max(verification_params_.min_matches, 5) )
+      num_discarded_early++;
+    if( std::max(stats.num_inliers_E, stats.num_inliers_H) > 5 )
+    {
+      num_verified++;
+      if( stats.num_inliers_E > stats.num_inliers_H )
+        num_E_models++;
     }
   }
+  if( !pairs.empty() )
+  {
+    std::cout<<"Verified "<<num_verified<<" of "<<pairs.size()<<" image pairs ("<<num_discarded_early
+             <<" discarded before the geometric verification, "<<num_E_models<<" with E and "
+             <<num_verified - num_E_models<<" with H as best model)"<<std::endl;
+    if( num_fine )
+      std::cout<<"Average time per pair : "<<matching_ms/num_fine<<" ms matching, "
+               <<verification_ms/num_fine<<" ms verification"<<std::endl;
+  }
+  if( num_coarse_verified )
+  {
+    // The time saved is estimated assuming that the discarded pairs would have taken the average time of
+    // the fully matched ones
+    double fine_pair_ms = num_fine ? (matching_ms + verification_ms)/num_fine : 0;
+    std::cout<<"Coarse verification : "<<num_coarse_passed<<" of "<<num_coarse_verified<<" pairs passed ("
+             <<100.0*num_coarse_passed/num_coarse_verified<<"%), "<<coarse_ms/num_coarse_verified
+             <<" ms per pair"<<std::endl;
+    std::cout<<"Full matching : "<<num_verified<<" of "<<num_fine<<" pairs verified ("
+             <<(num_fine ? 100.0*num_verified/num_fine : 0.0)<<"%), estimated time saved "
+             <<(num_coarse_rejected*fine_pair_ms - coarse_ms)/1000.0<<" s (CPU time)"<<std::endl;
+  }
+
+  // Images without pairs
+  for( int i = 0; i < num_images; i++ )
+    if( images_last_pair[i] == pairs.size() )
+      releaseImageFeatures(i);
+  features_released_ = true;
+
+  // Only the matched keypoints are still stored
+  size_t keypoints_bytes = 0;
+  for( auto &kps : keypoints_ )
+    keypoints_bytes += kps.memoryBytes();
+  std::cout<<"Memory used by the matched keypoints : "<<keypoints_bytes/1024<<" KB"<<std::endl;
+
+  buildTracks();
 }
 
-void FeatureMatcher::writeToFile ( const std::string& filename, bool normalize_points ) const
+std::vector<FeatureMatcher::MatchingStep>
+  FeatureMatcher::outOfCoreMatchingSteps( const std::vector< std::pair<int, int> > &pairs ) const
 {
-  FILE* fptr = fopen(filename.c_str(), "w");
+  // Memory used by the descriptors of each image while it is matched, including the prepared ones (e.g., the
+  // float copy of the byte descriptors, 4 times larger)
+  const size_t memory_factor = feature_backend_->binaryDescriptors() ? 1 : 5;
 
-  if (fptr == NULL) {
-    std::cerr << "Error: unable to open file " << filename;
+  // Each tile takes up to a third of the budget: two tiles are matched while the next one is read ahead
+  // (a tile has at least one image, even if its descriptors alone exceed the budget)
+  const int num_images = static_cast<int>(descriptors_.size());
+  std::vector<int> images_tile(num_images), tiles_begin;
+  size_t tile_bytes = 0;
+  for( int i = 0; i < num_images; i++ )
+  {
+    size_t bytes = descriptors_[i].total()*descriptors_[i].elemSize()*memory_factor;
+    if( tiles_begin.empty() || tile_bytes + bytes > memory_budget_/3 )
+    {
+      tiles_begin.push_back(i);
+      tile_bytes = 0;
+    }
+    tile_bytes += bytes;
+    images_tile[i] = static_cast<int>(tiles_begin.size()) - 1;
+  }
+  tiles_begin.push_back(num_images);
+
+  // Pairs grouped by pair of tiles, ordered by rows
+  std::map< std::pair<int, int>, std::vector<size_t> > tiles_pairs;
+  for( size_t k = 0; k < pairs.size(); k++ )
+  {
+    int tile_i = images_tile[pairs[k].first], tile_j = images_tile[pairs[k].second];
+    tiles_pairs[std::make_pair(std::min(tile_i, tile_j), std::max(tile_i, tile_j))].push_back(k);
+  }
+
+  std::vector<MatchingStep> steps;
+  steps.reserve(tiles_pairs.size());
+  for( auto &tp : tiles_pairs )
+  {
+    MatchingStep step;
+    for( int tile : { tp.first.first, tp.first.second } )
+    {
+      for( int i = tiles_begin[tile]; i < tiles_begin[tile + 1]; i++ )
+        step.images.push_back(i);
+      if( tp.first.first == tp.first.second )
+        break;
+    }
+    step.pairs.swap(tp.second);
+    steps.push_back(std::move(step));
+  }
+  return steps;
+}
+
+void FeatureMatcher::matchImagePair( int i, int j, std::vector<cv::DMatch> &inlier_matches, PairStats &stats,
+                                     bool concurrent_models,
+                                     const FeatureBackend::PreparedDescriptors *prepared_i,
+                                     const FeatureBackend::PreparedDescriptors *prepared_j ) const
+{
+  std::vector<cv::DMatch> matches;
+
+  //////////////////////////// Code to be completed (2/7) /////////////////////////////////
+  // Match descriptors between image i and image j, and perform geometric validation,
+  // possibly discarding the outliers (remember that features have been extracted
+  // from undistorted images that now has new_intrinsics_matrix_ as K matrix and
+  // no distortions)
+  // As geometric models, use both the Essential matrix and the Homograph matrix,
+  // both by setting new_intrinsics_matrix_ as K matrix.
+  // As threshold in the functions to estimate both models, you may use 1.0 or similar.
+  // Store inlier matches into the inlier_matches vector
+  // Do not set matches between two images if the amount of inliers matches
+  // (i.e., geomatrically verified matches) is small (say <= 5 matches)
+  // In case of success, set the matches with the function:
+  // setMatches( i, j, inlier_matches);
+  /////////////////////////////////////////////////////////////////////////////////////////
+  const VerificationParams &params = verification_params_;
+  inlier_matches.clear();
+
+  // Coarse stage, unless the strongest keypoints are all the keypoints of both images
+  if( params.coarse_keypoints > 0 &&
+      ( keypoints_[i].size() > params.coarse_keypoints || keypoints_[j].size() > params.coarse_keypoints ) &&
+      !coarseVerification( i, j, stats ) )
+  {
+    stats.coarse_rejected = true;
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<Knn2Match> knn_matches;
+  // Nearest neighbor in image i of each descriptor of image j, for the cross-check
+  std::vector<int> reverse_best;
+  float max_ratio = params.max_ratio;
+  if( descriptor_matching_ == LSH_MATCHING )
+  {
+    // Approximate matching through the LSH index of the j-th image, followed by a ratio test
+    lsh_indices_[j].knn2(descriptors_[i], knn_matches);
+    max_ratio = lsh_params_.max_ratio;
+    if( params.cross_check )
+    {
+      std::vector<Knn2Match> reverse_matches;
+      lsh_indices_[i].knn2(descriptors_[j], reverse_matches);
+      reverse_best.resize(reverse_matches.size());
+      for( size_t k = 0; k < reverse_matches.size(); k++ )
+        reverse_best[k] = reverse_matches[k].best_idx;
+    }
+  }
+  else
+  {
+    // Brute force matching, with the distance of the feature backend descriptors (Hamming for the binary
+    // ones, L2 otherwise: same results of cv::BFMatcher, see hammingKnn2())
+    feature_backend_->knn2(descriptors_[i], descriptors_[j], knn_matches,
+                           params.cross_check ? &reverse_best : nullptr, prepared_i, prepared_j);
+  }
+  filterKnnMatches( knn_matches, params.cross_check ? &reverse_best : nullptr, max_ratio, matches,
+                    stats.num_raw_matches );
+  stats.num_filtered_matches = static_cast<int>(matches.size());
+  stats.matching_ms = elapsedMs(start);
+
+  // At least 5 correspondences are needed to estimate the essential matrix, but with too few matches
+  // the pair is hopeless anyway: skip the robust estimation
+  if( static_cast<int>(matches.size()) < std::max(params.min_matches, 5) )
     return;
+
+  start = std::chrono::steady_clock::now();
+
+  // PROSAC draws the samples starting from the best matches
+  std::stable_sort(matches.begin(), matches.end(),
+                   []( const cv::DMatch &m0, const cv::DMatch &m1 ){ return m0.distance < m1.distance; });
+
+  // Prepare the points for the essential matrix
+  std::vector<cv::Point2f> pts0, pts1;
+  pts0.reserve(matches.size());
+  pts1.reserve(matches.size());
+  for (const auto &match : matches) {
+    pts0.push_back(keypoints_[i].point(match.queryIdx));
+    pts1.push_back(keypoints_[j].point(match.trainIdx));
+  }
+
+  // Estimate the essential matrix and the homography matrix, with masks output
+  std::vector<uchar> mask_E, mask_H;
+  cv::Mat E, H;
+  auto estimateE = [&]()
+  {
+    E = cv::findEssentialMat(pts0, pts1, new_intrinsics_matrix_, verification_method, params.confidence,
+                             params.threshold, mask_E);
+  };
+  auto estimateH = [&]()
+  {
+    H = cv::findHomography(pts0, pts1, verification_method, params.threshold, mask_H, 2000, params.confidence);
   };
+  if( concurrent_models )
+  {
+    auto H_result = std::async(std::launch::async, estimateH);
+    estimateE();
+    H_result.get();
+  }
+  else
+  {
+    estimateE();
+    estimateH();
+  }
 
-  fprintf(fptr, "%d %d %d\n", num_poses_, num_points_, num_observations_);
+  // Count inliers for both models
+  int num_inliers_E = (!E.empty()) ? cv::countNonZero(mask_E) : 0;
+  int num_inliers_H = (!H.empty()) ? cv::countNonZero(mask_H) : 0;
+  stats.num_inliers_E = num_inliers_E;
+  stats.num_inliers_H = num_inliers_H;
 
+  // Choose the mask with more inliers
+  std::vector<uchar>& best_mask = (num_inliers_E > num_inliers_H) ? mask_E : mask_H;
+
+  // Get inlier matches based on the best mask
+  for (size_t k = 0; k < best_mask.size(); k++) {
+    if (best_mask[k]) {
+      inlier_matches.push_back(matches[k]);
+    }
+  }
+
+  if( params.guided_matching && inlier_matches.size() > 5 )
+  {
+    if( num_inliers_E > num_inliers_H )
+    {
+      // Fundamental matrix from the (first) essential matrix, both images have new_intrinsics_matrix_ as K matrix
+      cv::Mat inv_K = new_intrinsics_matrix_.inv();
+      cv::Mat F = inv_K.t()*E.rowRange(0, 3)*inv_K;
+      stats.num_guided_matches = guidedMatching( i, j, F, false, inlier_matches );
+    }
+    else
+      stats.num_guided_matches = guidedMatching( i, j, H, true, inlier_matches );
+  }
+
+  // Back in the query features order
+  std::sort(inlier_matches.begin(), inlier_matches.end(),
+            []( const cv::DMatch &m0, const cv::DMatch &m1 ){ return m0.queryIdx < m1.queryIdx; });
+  stats.verification_ms = elapsedMs(start);
+  // The matches are set by the caller (see matchImagePairs()) only if inlier_matches.size() > 5
+  /////////////////////////////////////////////////////////////////////////////////////////
+}
+
+void FeatureMatcher::prepareCoarseFeatures()
+{
+  const int num_images = static_cast<int>(descriptors_.size());
+  coarse_descriptors_.assign(num_images, cv::Mat());
+
+  WorkStealingPool pool(num_threads_);
+  for( int i = 0; i < num_images; i++ )
+  {
+    pool.submit([&, i]()
+    {
+      const std::vector<int> &indices = coarse_indices_[i];
+      const cv::Mat &descriptors = descriptors_[i];
+      coarse_descriptors_[i].create( static_cast<int>(indices.size()), descriptors.cols, descriptors.type() );
+      for( size_t k = 0; k < indices.size(); k++ )
+        descriptors.row(indices[k]).copyTo(coarse_descriptors_[i].row(static_cast<int>(k)));
+
+      // Out-of-core: the full descriptors are loaded again only when the image is matched
+      if( memory_budget_ && features_files_[i] && !descriptors.empty() )
+        features_files_[i]->advise( descriptors.data, descriptors.total()*descriptors.elemSize(), false );
+    });
+  }
+  pool.wait();
+}
+
+bool FeatureMatcher::coarseVerification( int i, int j, PairStats &stats ) const
+{
+  auto start = std::chrono::steady_clock::now();
+  const VerificationParams &params = verification_params_;
+
+  // The coarse sets are small: always brute force matching
+  std::vector<Knn2Match> knn_matches;
+  std::vector<int> reverse_best;
+  feature_backend_->knn2( coarse_descriptors_[i], coarse_descriptors_[j], knn_matches,
+                          params.cross_check ? &reverse_best : nullptr );
+  std::vector<cv::DMatch> matches;
+  int num_raw_matches = 0;
+  filterKnnMatches( knn_matches, params.cross_check ? &reverse_best : nullptr, params.max_ratio, matches,
+                    num_raw_matches );
+
+  int num_inliers = 0;
+  if( static_cast<int>(matches.size()) >= std::max(params.coarse_min_inliers, 5) )
+  {
+    std::stable_sort(matches.begin(), matches.end(),
+                     []( const cv::DMatch &m0, const cv::DMatch &m1 ){ return m0.distance < m1.distance; });
+    std::vector<cv::Point2f> pts0, pts1;
+    pts0.reserve(matches.size());
+    pts1.reserve(matches.size());
+    for( const auto &match : matches )
+    {
+      pts0.push_back(keypoints_[i].point(coarse_indices_[i][match.queryIdx]));
+      pts1.push_back(keypoints_[j].point(coarse_indices_[j][match.trainIdx]));
+    }
+
+    // The homography is estimated only if the essential matrix is not enough
+    std::vector<uchar> mask;
+    cv::Mat E = cv::findEssentialMat( pts0, pts1, new_intrinsics_matrix_, verification_method, params.confidence,
+                                      params.threshold, mask );
+    num_inliers = E.empty() ? 0 : cv::countNonZero(mask);
+    if( num_inliers < params.coarse_min_inliers )
+    {
+      cv::Mat H = cv::findHomography( pts0, pts1, verification_method, params.threshold, mask, 2000,
+                                      params.confidence );
+      if( !H.empty() )
+        num_inliers = std::max( num_inliers, cv::countNonZero(mask) );
+    }
+  }
+
+  stats.coarse_verified = true;
+  stats.num_coarse_inliers = num_inliers;
+  stats.coarse_ms = elapsedMs(start);
+  return num_inliers >= params.coarse_min_inliers;
+}
+
+int FeatureMatcher::guidedMatching( int i, int j, const cv::Mat &model, bool homography,
+                                    std::vector<cv::DMatch> &inlier_matches ) const
+{
+  const KeypointsStore &features0 = keypoints_[i], &features1 = keypoints_[j];
+  const cv::Mat &descriptors0 = descriptors_[i], &descriptors1 = descriptors_[j];
+  const float max_ratio = ( descriptor_matching_ == LSH_MATCHING ) ? lsh_params_.max_ratio
+                                                                    : verification_params_.max_ratio;
+  const double r = verification_params_.threshold;
+
+  double m[9];
+  for( int k = 0; k < 9; k++ )
+    m[k] = model.at<double>(k/3, k%3);
+
+  // Features already matched, and the worst descriptor distance among the verified matches: guided
+  // matches should not be worse than that
+  std::vector<char> matched0(features0.size(), 0), matched1(features1.size(), 0);
+  float max_distance = 0;
+  for( auto &match : inlier_matches )
+  {
+    matched0[match.queryIdx] = matched1[match.trainIdx] = 1;
+    max_distance = std::max(max_distance, match.distance);
+  }
+
+  // Candidates of each query that are compatible with the model, matched afterwards by the backend with a
+  // single call
+  KeypointsGrid grid(features1);
+  std::vector<int> queries, offsets(1, 0), candidates;
+  for( int q = 0; q < features0.size(); q++ )
+  {
+    if( matched0[q] )
+      continue;
+
+    const cv::Point2f p = features0.point(q);
+
+    // Homography transfer (x, y) or normalized epipolar line a*x + b*y + c = 0 of the query in image j
+    double x = 0, y = 0, a = 0, b = 0, c = 0;
+    if( homography )
+    {
+      double w = m[6]*p.x + m[7]*p.y + m[8];
+      if( std::abs(w) < 1e-12 )
+        continue;
+      x = (m[0]*p.x + m[1]*p.y + m[2])/w;
+      y = (m[3]*p.x + m[4]*p.y + m[5])/w;
+    }
+    else
+    {
+      a = m[0]*p.x + m[1]*p.y + m[2];
+      b = m[3]*p.x + m[4]*p.y + m[5];
+      c = m[6]*p.x + m[7]*p.y + m[8];
+      double norm = std::sqrt(a*a + b*b);
+      if( norm < 1e-12 )
+        continue;
+      a /= norm; b /= norm; c /= norm;
+    }
+
+    auto testCandidate = [&]( int t )
+    {
+      if( matched1[t] )
+        return;
+      const cv::Point2f pt = features1.point(t);
+      if( homography )
+      {
+        if( (x - pt.x)*(x - pt.x) + (y - pt.y)*(y - pt.y) > r*r )
+          return;
+      }
+      else
+      {
+        // Symmetric check: the candidate should be close to the epipolar line of the query, and vice versa
+        double d1 = a*pt.x + b*pt.y + c,
+               a0 = m[0]*pt.x + m[3]*pt.y + m[6], b0 = m[1]*pt.x + m[4]*pt.y + m[7], c0 = m[2]*pt.x + m[5]*pt.y + m[8],
+               d0 = a0*p.x + b0*p.y + c0;
+        if( std::abs(d1) > r || d0*d0 > r*r*(a0*a0 + b0*b0) )
+          return;
+      }
+      candidates.push_back(t);
+    };
+
+    if( homography )
+    {
+      grid.forEach( grid.cellX(x - r), grid.cellX(x + r), grid.cellY(y - r), grid.cellY(y + r), testCandidate );
+    }
+    else
+    {
+      // Visit the band of cells around the epipolar line, by columns if the line is mostly horizontal,
+      // by rows otherwise
+      const double cell_size = guided_matching_cell_size;
+      if( std::abs(b) >= std::abs(a) )
+      {
+        for( int cx = 0; cx < grid.cols; cx++ )
+        {
+          double xa = grid.x0 + cx*cell_size, xb = xa + cell_size,
+                 ya = -(a*xa + c)/b, yb = -(a*xb + c)/b, band = r/std::abs(b);
+          grid.forEach( cx, cx, grid.cellY(std::min(ya, yb) - band), grid.cellY(std::max(ya, yb) + band),
+                        testCandidate );
+        }
+      }
+      else
+      {
+        for( int cy = 0; cy < grid.rows; cy++ )
+        {
+          double ya = grid.y0 + cy*cell_size, yb = ya + cell_size,
+                 xa = -(b*ya + c)/a, xb = -(b*yb + c)/a, band = r/std::abs(a);
+          grid.forEach( grid.cellX(std::min(xa, xb) - band), grid.cellX(std::max(xa, xb) + band), cy, cy,
+                        testCandidate );
+        }
+      }
+    }
+
+    if( static_cast<int>(candidates.size()) > offsets.back() )
+    {
+      queries.push_back(q);
+      offsets.push_back(static_cast<int>(candidates.size()));
+    }
+  }
+
+  std::vector<Knn2Match> knn_matches;
+  feature_backend_->candidatesKnn2( descriptors0, queries, descriptors1, offsets, candidates, knn_matches );
+
+  // Ratio test among the candidates inside the band
+  std::vector<cv::DMatch> guided_matches;
+  for( size_t k = 0; k < queries.size(); k++ )
+  {
+    const Knn2Match &km = knn_matches[k];
+    if( km.best_dist <= max_distance &&
+        ( max_ratio >= 1.0f || km.second_idx < 0 || km.best_dist < max_ratio*km.second_dist ) )
+      guided_matches.emplace_back(queries[k], km.best_idx, km.best_dist);
+  }
+
+  // Each feature of image j can be matched only once: keep its best guided match
+  std::sort(guided_matches.begin(), guided_matches.end(), []( const cv::DMatch &m0, const cv::DMatch &m1 )
+  {
+    return m0.trainIdx < m1.trainIdx || (m0.trainIdx == m1.trainIdx && m0.distance < m1.distance) ||
+           (m0.trainIdx == m1.trainIdx && m0.distance == m1.distance && m0.queryIdx < m1.queryIdx);
+  });
+  int num_added = 0;
+  for( size_t k = 0; k < guided_matches.size(); k++ )
+  {
+    if( k > 0 && guided_matches[k].trainIdx == guided_matches[k - 1].trainIdx )
+      continue;
+    inlier_matches.push_back(guided_matches[k]);
+    num_added++;
+  }
+  return num_added;
+}
+
+void FeatureMatcher::writeToFile ( const std::string& filename, bool normalize_points, bool binary ) const
+{
   double *tmp_observations;
   cv::Mat dst_pts;
-  if(normalize_points)
+  if(normalize_points && num_observations_ > 0)
   {
     cv::Mat src_obs( num_observations_,1, cv::traits::Type<cv::Vec2d>::value,
                      const_cast<double *>(observations_.data()));
@@ -168,6 +1221,23 @@ void FeatureMatcher::writeToFile ( const std::string& filename, bool normalize_p
     tmp_observations = const_cast<double *>(observations_.data());
   }
 
+  if( binary )
+  {
+    bool has_colors = colors_.size() == 3*num_points_;
+    BinaryDataFile::write( filename, num_poses_, num_points_, num_observations_, pose_index_.data(),
+                           point_index_.data(), tmp_observations, has_colors ? colors_.data() : nullptr );
+    return;
+  }
+
+  FILE* fptr = fopen(filename.c_str(), "w");
+
+  if (fptr == NULL) {
+    std::cerr << "Error: unable to open file " << filename;
+    return;
+  };
+
+  fprintf(fptr, "%d %d %d\n", num_poses_, num_points_, num_observations_);
+
   for (int i = 0; i < num_observations_; ++i)
   {
     fprintf(fptr, "%d %d", pose_index_[i], point_index_[i]);
@@ -186,38 +1256,155 @@ void FeatureMatcher::writeToFile ( const std::string& filename, bool normalize_p
   fclose(fptr);
 }
 
-void FeatureMatcher::testMatches( double scale )
+std::vector< std::vector< std::pair<int, int> > > FeatureMatcher::posesObservations() const
 {
-  // For each pose, prepare a map that reports the pairs [point index, observation index]
-  std::vector< std::map<int,int> > cam_observation( num_poses_ );
+  std::vector< std::vector< std::pair<int, int> > > poses_obs( num_poses_ );
   for( int i_obs = 0; i_obs < num_observations_; i_obs++ )
+    poses_obs[pose_index_[i_obs]].emplace_back(point_index_[i_obs], i_obs);
+  for( auto &obs : poses_obs )
+    std::sort(obs.begin(), obs.end());
+  return poses_obs;
+}
+
+int FeatureMatcher::numSharedPoints( const std::vector< std::pair<int, int> > &obs0,
+                                     const std::vector< std::pair<int, int> > &obs1 )
+{
+  int num_shared = 0;
+  for( size_t k0 = 0, k1 = 0; k0 < obs0.size() && k1 < obs1.size(); )
   {
-    int i_cam = pose_index_[i_obs], i_pt = point_index_[i_obs];
-    cam_observation[i_cam][i_pt] = i_obs;
+    if( obs0[k0].first < obs1[k1].first )
+      k0++;
+    else if( obs1[k1].first < obs0[k0].first )
+      k1++;
+    else
+    {
+      num_shared++;
+      k0++;
+      k1++;
+    }
   }
+  return num_shared;
+}
+
+cv::Mat FeatureMatcher::drawPoseMatches( int r, int c, const std::vector< std::vector< std::pair<int, int> > > &poses_obs,
+                                         ImageCache &images, double scale ) const
+{
+  std::shared_ptr<const cv::Mat> img0 = images.get(pose_images_[r]), img1 = images.get(pose_images_[c]);
+  if( img0->empty() || img1->empty() )
+    return cv::Mat();
 
+  // Observations of the points shared by the two poses (both lists are sorted by point index)
+  std::vector<cv::DMatch> matches;
+  std::vector<cv::KeyPoint> features0, features1;
+  const auto &obs0 = poses_obs[r], &obs1 = poses_obs[c];
+  for( size_t k0 = 0, k1 = 0; k0 < obs0.size() && k1 < obs1.size(); )
+  {
+    if( obs0[k0].first < obs1[k1].first )
+      k0++;
+    else if( obs1[k1].first < obs0[k0].first )
+      k1++;
+    else
+    {
+      int i_obs0 = obs0[k0++].second, i_obs1 = obs1[k1++].second;
+      matches.emplace_back(static_cast<int>(features0.size()), static_cast<int>(features1.size()), 0);
+      features0.emplace_back(scale*observations_[2*i_obs0], scale*observations_[2*i_obs0 + 1], 0.0);
+      features1.emplace_back(scale*observations_[2*i_obs1], scale*observations_[2*i_obs1 + 1], 0.0);
+    }
+  }
+
+  cv::Mat dbg_img;
+  cv::drawMatches(*img0, features0, *img1, features1, matches, dbg_img);
+  return dbg_img;
+}
+
+cv::Mat FeatureMatcher::readScaledUndistortedImage( int i, double scale )
+{
+  cv::Mat img = readUndistortedImage(images_names_[i]);
+  if( !img.empty() && scale != 1.0 )
+    cv::resize(img, img, cv::Size(), scale, scale, scale < 1.0 ? cv::INTER_AREA : cv::INTER_LINEAR);
+  return img;
+}
+
+int FeatureMatcher::exportMatches( const std::string &output_dir, double scale, int max_pairs )
+{
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(output_dir, ec);
+  if( ec )
+  {
+    std::cerr<<"Can't create the matches directory "<<output_dir<<" : "<<ec.message()<<std::endl;
+    return 0;
+  }
+
+  // Pose pairs with at least a shared point, possibly evenly sampled
+  auto poses_obs = posesObservations();
+  std::vector< std::pair<int, int> > pairs;
   for( int r = 0; r < num_poses_; r++ )
+    for( int c = r + 1; c < num_poses_; c++ )
+      if( numSharedPoints(poses_obs[r], poses_obs[c]) )
+        pairs.emplace_back(r, c);
+  if( max_pairs > 0 && static_cast<int>(pairs.size()) > max_pairs )
   {
-    for (int c = r + 1; c < num_poses_; c++)
+    std::vector< std::pair<int, int> > sampled_pairs(max_pairs);
+    for( int k = 0; k < max_pairs; k++ )
+      sampled_pairs[k] = pairs[static_cast<size_t>(k)*pairs.size()/max_pairs];
+    pairs.swap(sampled_pairs);
+  }
+
+  // Pairs are rendered by tiles of poses that fit into the images cache: each image is decoded about once
+  // per tile of pairs it belongs to, instead of once per pair
+  WorkStealingPool pool(num_threads_);
+  const int cache_size = std::max( export_min_cached_images, 3*pool.numThreads() ),
+            tile_size = std::max( 1, cache_size/3 );
+  std::stable_sort(pairs.begin(), pairs.end(),
+                   [tile_size]( const std::pair<int, int> &p0, const std::pair<int, int> &p1 )
+                   {
+                     return std::make_pair(p0.first/tile_size, p0.second/tile_size) <
+                            std::make_pair(p1.first/tile_size, p1.second/tile_size);
+                   });
+  ImageCache images( cache_size, [this, scale]( int i ){ return readScaledUndistortedImage(i, scale); } );
+
+  std::atomic<int> num_written(0);
+  std::mutex log_mutex;
+  for( auto &pair : pairs )
+  {
+    pool.submit([&, pair]()
     {
-      int num_mathces = 0;
-      std::vector<cv::DMatch> matches;
-      std::vector<cv::KeyPoint> features0, features1;
-      for (auto const &co_iter: cam_observation[r])
+      int r = pair.first, c = pair.second;
+      cv::Mat dbg_img = drawPoseMatches( r, c, poses_obs, images, scale );
+      char filename[64];
+      snprintf(filename, sizeof(filename), "matches_%04d_%04d.jpg", pose_images_[r], pose_images_[c]);
+      std::string path = (boost::filesystem::path(output_dir)/filename).string();
+      if( !dbg_img.empty() && cv::imwrite(path, dbg_img) )
       {
-        if (cam_observation[c].find(co_iter.first) != cam_observation[c].end())
-        {
-          features0.emplace_back(observations_[2*co_iter.second],observations_[2*co_iter.second + 1], 0.0);
-          features1.emplace_back(observations_[2*cam_observation[c][co_iter.first]],observations_[2*cam_observation[c][co_iter.first] + 1], 0.0);
-          matches.emplace_back(num_mathces,num_mathces, 0);
-          num_mathces++;
-        }
+        num_written++;
+      }
+      else
+      {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cerr<<"Can't write the matches image "<<path<<std::endl;
       }
-      cv::Mat img0 = readUndistortedImage(images_names_[r]),
-          img1 = readUndistortedImage(images_names_[c]),
-          dbg_img;
+    });
+  }
+  pool.wait();
 
-      cv::drawMatches(img0, features0, img1, features1, matches, dbg_img);
+  std::cout<<"Exported "<<num_written<<" of "<<pairs.size()<<" matches images to "<<output_dir<<" ("
+           <<images.numLoads()<<" images decoded)"<<std::endl;
+  return num_written;
+}
+
+void FeatureMatcher::testMatches( double scale )
+{
+  auto poses_obs = posesObservations();
+  // The first image of the pairs is the same for a whole row
+  ImageCache images( 2, [this]( int i ){ return readUndistortedImage(images_names_[i]); } );
+
+  for( int r = 0; r < num_poses_; r++ )
+  {
+    for (int c = r + 1; c < num_poses_; c++)
+    {
+      cv::Mat dbg_img = drawPoseMatches( r, c, poses_obs, images, 1.0 );
+      if( dbg_img.empty() )
+        continue;
       cv::resize(dbg_img, dbg_img, cv::Size(), scale, scale);
       cv::imshow("", dbg_img);
       if (cv::waitKey() == 27)
@@ -228,101 +1415,75 @@ void FeatureMatcher::testMatches( double scale )
 
 void FeatureMatcher::setMatches( int pos0_id, int pos1_id, const std::vector<cv::DMatch> &matches )
 {
+  // The matches are just collected here, the observations are computed from all of them by buildTracks()
+  track_builder_.addMatches(pos0_id, pos1_id, matches);
+}
 
-  const auto &features0 = features_[pos0_id];
-  const auto &features1 = features_[pos1_id];
-
-  auto pos_iter0 = pose_id_map_.find(pos0_id),
-      pos_iter1 = pose_id_map_.find(pos1_id);
+void FeatureMatcher::buildTracks()
+{
+  Tracks tracks;
+  track_builder_.build(tracks);
 
-  // Already included position?
-  if( pos_iter0 == pose_id_map_.end() )
-  {
-    pose_id_map_[pos0_id] = num_poses_;
-    pos0_id = num_poses_++;
-  }
-  else
-    pos0_id = pose_id_map_[pos0_id];
+  point_index_.clear();
+  pose_index_.clear();
+  observations_.clear();
+  colors_.clear();
+  pose_images_.clear();
 
-  // Already included position?
-  if( pos_iter1 == pose_id_map_.end() )
+  // Poses are the images with at least one observation, by increasing image index
+  std::vector<int> image_pose(keypoints_.size(), -1);
+  for( int i : tracks.images_idx )
+    image_pose[i] = 0;
+  for( int i = 0; i < static_cast<int>(image_pose.size()); i++ )
   {
-    pose_id_map_[pos1_id] = num_poses_;
-    pos1_id = num_poses_++;
+    if( image_pose[i] < 0 )
+      continue;
+    image_pose[i] = static_cast<int>(pose_images_.size());
+    pose_images_.push_back(i);
   }
-  else
-    pos1_id = pose_id_map_[pos1_id];
-
-  for( auto &match:matches)
-  {
 
-    // Already included observations?
-    uint64_t obs_id0 = poseFeatPairID(pos0_id, match.queryIdx ),
-        obs_id1 = poseFeatPairID(pos1_id, match.trainIdx );
-    auto pt_iter0 = point_id_map_.find(obs_id0),
-        pt_iter1 = point_id_map_.find(obs_id1);
-    // New point
-    if( pt_iter0 == point_id_map_.end() && pt_iter1 == point_id_map_.end() )
-    {
-      int pt_idx = num_points_++;
-      point_id_map_[obs_id0] = point_id_map_[obs_id1] = pt_idx;
-
-      point_index_.push_back(pt_idx);
-      point_index_.push_back(pt_idx);
-      pose_index_.push_back(pos0_id);
-      pose_index_.push_back(pos1_id);
-      observations_.push_back(features0[match.queryIdx].pt.x);
-      observations_.push_back(features0[match.queryIdx].pt.y);
-      observations_.push_back(features1[match.trainIdx].pt.x);
-      observations_.push_back(features1[match.trainIdx].pt.y);
+  num_poses_ = static_cast<int>(pose_images_.size());
+  num_points_ = tracks.numTracks();
+  num_observations_ = static_cast<int>(tracks.images_idx.size());
 
-      // Average color between two corresponding features (suboptimal since we shouls also consider
-      // the other observations of the same point in the other images)
-      cv::Vec3f color = (cv::Vec3f(feats_colors_[pos0_id][match.queryIdx]) +
-                        cv::Vec3f(feats_colors_[pos1_id][match.trainIdx]))/2;
+  point_index_.reserve(num_observations_);
+  pose_index_.reserve(num_observations_);
+  observations_.reserve(2*num_observations_);
+  colors_.reserve(3*num_points_);
 
-      colors_.push_back(cvRound(color[2]));
-      colors_.push_back(cvRound(color[1]));
-      colors_.push_back(cvRound(color[0]));
-
-      num_observations_++;
-      num_observations_++;
-    }
-      // New observation
-    else if( pt_iter0 == point_id_map_.end() )
+  for( int pt_idx = 0; pt_idx < num_points_; pt_idx++ )
+  {
+    cv::Vec3f color(0, 0, 0);
+    for( int k = tracks.offsets[pt_idx]; k < tracks.offsets[pt_idx + 1]; k++ )
     {
-      int pt_idx = point_id_map_[obs_id1];
-      point_id_map_[obs_id0] = pt_idx;
-
+      int i = tracks.images_idx[k], f = tracks.features_idx[k];
       point_index_.push_back(pt_idx);
-      pose_index_.push_back(pos0_id);
-      observations_.push_back(features0[match.queryIdx].pt.x);
-      observations_.push_back(features0[match.queryIdx].pt.y);
-      num_observations_++;
+      pose_index_.push_back(image_pose[i]);
+      cv::Point2f pt = keypoints_[i].point(f);
+      observations_.push_back(pt.x);
+      observations_.push_back(pt.y);
+      color += cv::Vec3f(keypoints_[i].color(f));
     }
-    else if( pt_iter1 == point_id_map_.end() )
-    {
-      int pt_idx = point_id_map_[obs_id0];
-      point_id_map_[obs_id1] = pt_idx;
 
-      point_index_.push_back(pt_idx);
-      pose_index_.push_back(pos1_id);
-      observations_.push_back(features1[match.trainIdx].pt.x);
-      observations_.push_back(features1[match.trainIdx].pt.y);
-      num_observations_++;
-    }
-//    else if( pt_iter0->second != pt_iter1->second )
-//    {
-//      std::cerr<<"Shared observations does not share 3D point!"<<std::endl;
-//    }
+    // Average color among all the observations of the point
+    color /= static_cast<float>(tracks.offsets[pt_idx + 1] - tracks.offsets[pt_idx]);
+    colors_.push_back(cvRound(color[2]));
+    colors_.push_back(cvRound(color[1]));
+    colors_.push_back(cvRound(color[0]));
   }
+
+  std::cout<<"Built "<<num_points_<<" tracks from "<<track_builder_.numMatches()<<" matches ("
+           <<tracks.num_rejected<<" inconsistent tracks discarded)"<<std::endl;
 }
+
 void FeatureMatcher::reset()
 {
   point_index_.clear();
   pose_index_.clear();
   observations_.clear();
   colors_.clear();
+  pose_images_.clear();
+  track_builder_.clear();
 
   num_poses_ = num_points_ = num_observations_ = 0;
 }
@@ -1,13 +1,69 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <opencv2/opencv.hpp>
 
+#include "feature_backend.h"
+#include "image_cache.h"
+#include "image_undistorter.h"
+#include "io_utils.h"
+#include "keypoints_selection.h"
+#include "keypoints_store.h"
+#include "lsh_index.h"
+#include "track_builder.h"
+
 class FeatureMatcher
 {
  public:
 
+  // How the lens distortion is removed from the extracted features
+  enum UndistortionMode
+  {
+    // Undistort each whole image, then extract the features from the undistorted image
+    UNDISTORT_IMAGE,
+    // Extract the features from the raw image, then undistort only the keypoint coordinates (the colors are
+    // sampled from the raw image)
+    UNDISTORT_KEYPOINTS
+  };
+
+  // How the descriptors of two images are compared
+  enum DescriptorMatching
+  {
+    // Exact nearest neighbor of each descriptor, by exhaustive comparison
+    BRUTE_FORCE_MATCHING,
+    // Approximate nearest neighbors retrieved from a multi-probe LSH index built for each image, followed by
+    // a ratio test (see BinaryLshIndex::Params)
+    LSH_MATCHING
+  };
+
+  // Parameters of the filtering and of the geometric verification of the matches between two images
+  struct VerificationParams
+  {
+    // Ratio test threshold between the distances of the best and second best neighbors, used with
+    // BRUTE_FORCE_MATCHING (>= 1 to disable it, with LSH_MATCHING BinaryLshIndex::Params::max_ratio is used)
+    float max_ratio = 0.8f;
+    // Keep only the matches whose features are the nearest neighbors of each other
+    bool cross_check = true;
+    // Image pairs with fewer filtered matches are discarded without estimating any geometric model
+    int min_matches = 15;
+    // Inlier threshold (in pixels) and confidence of the robust estimation of the E and H models
+    double threshold = 1.0;
+    double confidence = 0.999;
+    // After the verification, look for further matches between the features not matched yet, searching only
+    // near the epipolar lines (or the homography transfers) of the best model, see guidedMatching()
+    bool guided_matching = false;
+    // Coarse to fine verification: if > 0, each pair is first matched and verified using only the
+    // coarse_keypoints strongest keypoints (by response) of the two images, and only the pairs with at least
+    // coarse_min_inliers inliers are then matched with all the keypoints (most of the pairs of an
+    // exhaustive matching have no overlap, and are discarded at a fraction of the cost). The strongest
+    // keypoints are selected by extractFeatures(): coarse_keypoints must be set before calling it
+    int coarse_keypoints = 0;
+    int coarse_min_inliers = 10;
+  };
+
   // Constructor: it require the camera intrinsics matrix, its distortion coefficients and an optional
   // focal length scaling factor
   FeatureMatcher( cv::Mat intrinsics_matrix, cv::Mat dist_coeffs, double focal_scale = 1.0 );
@@ -15,49 +71,242 @@ class FeatureMatcher
   // Set the list of names of the images from which to extract the features
   void setImagesNames( const std::vector<std::string> &images_names ) { images_names_ = images_names; };
 
-  // Extract from each image a set of salient points and compute descriptors
+  // Set the number of worker threads used by the feature extraction and matching (<= 0 means all the available cores)
+  void setNumThreads( int num_threads ) { num_threads_ = num_threads; };
+
+  // Set how the lens distortion is removed (default: UNDISTORT_IMAGE). In both cases, the keypoints are stored
+  // in the frame of the undistorted images, i.e., with new_intrinsics_matrix_ as K matrix and no distortions
+  void setUndistortionMode( UndistortionMode mode ) { undistortion_mode_ = mode; };
+
+  // Set how the descriptors are compared (default: BRUTE_FORCE_MATCHING), to be called before extractFeatures():
+  // with LSH_MATCHING, the LSH index of each image is built once by extractFeatures() with the given parameters
+  void setDescriptorMatching( DescriptorMatching mode,
+                              const BinaryLshIndex::Params &lsh_params = BinaryLshIndex::Params() )
+  {
+    descriptor_matching_ = mode;
+    lsh_params_ = lsh_params;
+  };
+
+  // Set the feature detector and descriptor (default: ORB), to be called before extractFeatures().
+  // Return false if the backend is not available. LSH and retrieval matching require binary descriptors
+  bool setFeatureBackend( FeatureBackend::Type type );
+
+  // Set the spatial selection of the detected keypoints (default: disabled, i.e., all the detected keypoints
+  // are used), to be called before extractFeatures(): fewer, evenly distributed keypoints reduce both the
+  // memory used by the features and the matching time
+  void setKeypointsSelection( const KeypointsSelectionParams &params ) { keypoints_selection_ = params; };
+
+  // Set the parameters used to filter and verify the matches of each image pair
+  void setVerificationParams( const VerificationParams &params ) { verification_params_ = params; };
+
+  // Enable the persistent feature cache in the cache_dir directory (an empty string disables it): features
+  // are stored there by extractFeatures(), and loaded (through mmap, without copying the descriptors) in
+  // later runs for the images whose content and extraction parameters are unchanged
+  void setFeatureCache( const std::string &cache_dir ) { feature_cache_dir_ = cache_dir; };
+
+  // Bound the memory used by the descriptors (0, the default, means no bound), to be called before
+  // extractFeatures(). With a bound, the descriptors are spilled to a temporary file inside spill_dir (if
+  // empty, the system temporary directory) while they are extracted, and the file is then memory mapped.
+  // The image pairs are matched by tiles of images whose descriptors fit into budget_bytes: the two tiles
+  // being matched are loaded once and used for all the pairs between them, so the peak memory of the
+  // descriptors does not depend on the number of images
+  void setMemoryBudget( size_t budget_bytes, const std::string &spill_dir = std::string() )
+  {
+    memory_budget_ = budget_bytes;
+    spill_dir_ = spill_dir;
+  };
+
+  // Extract from each image a set of salient points and compute descriptors. Images are processed by a
+  // pipeline (decoding -> undistortion -> detection/description -> color sampling) that runs on multiple
+  // threads: results are stored by image index, so they do not depend on the number of threads
   void extractFeatures();
 
-  // Perform exhaustive matching between features descriptors, and internally store the results
+  // Perform exhaustive matching between features descriptors, and internally store the results.
+  // Image pairs are matched in parallel (see setNumThreads()), the results do not depend on the number of threads.
+  // As soon as the last pair of an image has been matched, its descriptors and unmatched keypoints are
+  // released: after a matching (also the ones below), extractFeatures() must be called again before another one
   void exhaustiveMatching();
 
-  // Write the results to file. If normalize_points is true, normalize observations as seen by the canonical camera
-  void writeToFile ( const std::string& filename, bool normalize_points ) const;
+  // Perform matching for images acquired in sequence (the images names order): each image is matched only
+  // with the following window_size images. If loop_stride > 0, loop closures are also probed by matching
+  // every loop_stride-th image with all the other loop_stride-th images outside the window.
+  // Results are stored as in exhaustiveMatching()
+  void sequentialMatching( int window_size, int loop_stride = 0 );
+
+  // Set the vocabulary tree used by retrievalMatching(): if filename is not empty and the file exists, the
+  // vocabulary is loaded from it, otherwise it is trained from the extracted descriptors with the given
+  // branching factor and depth (and saved to filename, if not empty)
+  void setVocabulary( const std::string &filename, int branching = 10, int depth = 4 )
+  {
+    vocabulary_filename_ = filename;
+    vocabulary_branching_ = branching;
+    vocabulary_depth_ = depth;
+  };
+
+  // Perform matching only between each image and the num_neighbors images most similar to it, retrieved
+  // with a bag of binary words vocabulary tree: the number of matched pairs grows linearly with the number
+  // of images. Results are stored as in exhaustiveMatching()
+  void retrievalMatching( int num_neighbors );
+
+  // Write the results to file. If normalize_points is true, normalize observations as seen by the canonical camera.
+  // If binary is true, the file is written in the memory mappable binary format (see BinaryDataFile), that
+  // keeps the full precision of the observations and is loaded much faster than the text one
+  void writeToFile ( const std::string& filename, bool normalize_points, bool binary = false ) const;
 
 //  // Read from file (used for debug)
 //  void readFromFile ( const std::string& filename, bool load_colors = false );
 
-  // Show matches collecting data  (rescale images with scale)
+  // Show matches collecting data  (rescale images with scale). Each window waits for a key, ESC to stop
   void testMatches( double scale = 1.0 );
 
+  // Headless alternative to testMatches(): draw the matches (the observations of the points shared by two poses)
+  // of all the pose pairs with at least a shared point, or of max_pairs pairs evenly sampled among them if
+  // max_pairs > 0, and write them as JPEG images (matches_<image i>_<image j>.jpg) into output_dir.
+  // Pairs are drawn in parallel (see setNumThreads()) on the undistorted images downscaled by scale, taken
+  // from an LRU cache so that each image is decoded a few times, not once per pair. Return the number of
+  // written images
+  int exportMatches( const std::string &output_dir, double scale = 0.5, int max_pairs = 0 );
+
   // Clear everything
   void reset();
 
+  // Get the object used to undistort the images: it holds the remap tables built from the calibration
+  // parameters, and it can be shared with any other code that needs undistorted images
+  std::shared_ptr<const ImageUndistorter> undistorter() const { return undistorter_; };
+
  private:
 
   // Read from file an image and undistort it, possibly by rescaling the focal length
   // (see the focal_scale parameter of the constructor)
   cv::Mat readUndistortedImage(const std::string& filename );
 
-  // Get a single, unique ID from a pair [position ID, feature ID] (used as hash)
-  uint64_t poseFeatPairID( int pose_id, int feat_id )
+  // Read the i-th image, undistort it and resize it by scale
+  cv::Mat readScaledUndistortedImage( int i, double scale );
+
+  // Observations of each pose, as (point index, observation index) pairs sorted by point index
+  std::vector< std::vector< std::pair<int, int> > > posesObservations() const;
+
+  // Number of points shared by two poses, given their observations (see posesObservations())
+  static int numSharedPoints( const std::vector< std::pair<int, int> > &obs0,
+                              const std::vector< std::pair<int, int> > &obs1 );
+
+  // Draw the observations of the points shared by the r-th and c-th poses, on their images taken from images
+  // (the observations are scaled by scale, the images must be already scaled). Return an empty matrix if
+  // the images can't be read
+  cv::Mat drawPoseMatches( int r, int c, const std::vector< std::vector< std::pair<int, int> > > &poses_obs,
+                           ImageCache &images, double scale ) const;
+
+  // Extract salient points, descriptors and colors from the i-th image (into features_[i], descriptors_[i]
+  // and feats_colors_[i])
+  void extractImageFeatures( int i, const cv::Mat &img );
+
+  // Hash of all the parameters that affect the extracted features, used as part of the feature cache keys
+  uint64_t extractionParamsHash() const;
+
+  // Move the keypoints of the i-th image, extracted from the raw image, into the undistorted image frame
+  void undistortKeypoints( int i );
+
+  // Move the extracted keypoints and colors of the i-th image into its compact store (keypoints_[i])
+  void storeImageKeypoints( int i );
+
+  // Release the data of the i-th image used only by the matching: descriptors, LSH index, and the keypoints
+  // without matches (the matched ones are kept, as they are the observations of the tracks)
+  void releaseImageFeatures( int i );
+
+  // Match (in parallel) the given image pairs, and add the verified matches in the pairs order
+  void matchImagePairs( const std::vector< std::pair<int, int> > &pairs );
+
+  // Statistics of the matching of an image pair
+  struct PairStats
+  {
+    int num_raw_matches = 0, num_filtered_matches = 0, num_inliers_E = 0, num_inliers_H = 0, num_guided_matches = 0;
+    double matching_ms = 0, verification_ms = 0;
+    // Coarse verification (see VerificationParams::coarse_keypoints): whether it has been performed, best
+    // model inliers, and whether the pair has been discarded by it
+    bool coarse_verified = false;
+    int num_coarse_inliers = 0;
+    bool coarse_rejected = false;
+    double coarse_ms = 0;
+  };
+
+  // Select the strongest keypoints of each image, and copy their descriptors, for the coarse verification
+  void prepareCoarseFeatures();
+
+  // Match and verify the i-th and j-th images with their strongest keypoints only, return true if the pair
+  // passes the coarse verification (it can be called concurrently from multiple threads)
+  bool coarseVerification( int i, int j, PairStats &stats ) const;
+
+  // Step of the out-of-core matching: the pairs between two tiles of images, and the images of the two tiles
+  struct MatchingStep
   {
-    return static_cast<uint64_t>(pose_id) | static_cast<uint64_t>(feat_id)<<32;
+    std::vector<int> images;
+    std::vector<size_t> pairs;
   };
 
-  // Add the matches between two images
+  // Group the image pairs (their indices) into steps whose descriptors fit into the memory budget (see
+  // setMemoryBudget()). Each tile is a range of consecutive images, and the steps walk the pairs of tiles
+  // by rows: the first tile is kept while the second one changes
+  std::vector<MatchingStep> outOfCoreMatchingSteps( const std::vector< std::pair<int, int> > &pairs ) const;
+
+  // Match the descriptors of the i-th and j-th images, and store the geometrically verified matches into
+  // inlier_matches (it can be called concurrently from multiple threads). If concurrent_models is true,
+  // the E and H models are estimated in parallel, on two threads. prepared_i and prepared_j are the
+  // optional descriptors of the two images prepared by the feature backend
+  void matchImagePair( int i, int j, std::vector<cv::DMatch> &inlier_matches, PairStats &stats,
+                       bool concurrent_models,
+                       const FeatureBackend::PreparedDescriptors *prepared_i = nullptr,
+                       const FeatureBackend::PreparedDescriptors *prepared_j = nullptr ) const;
+
+  // Add to the verified inlier_matches between the i-th and j-th images the matches found by comparing each
+  // still unmatched feature of image i only with the unmatched features of image j that lie within the inlier
+  // threshold from its epipolar line (fundamental matrix model) or homography transfer (homography model).
+  // Return the number of added matches
+  int guidedMatching( int i, int j, const cv::Mat &model, bool homography,
+                      std::vector<cv::DMatch> &inlier_matches ) const;
+
+  // Add the matches between two images (pos0_id and pos1_id are the images indices)
   void setMatches( int pos0_id, int pos1_id, const std::vector<cv::DMatch> &matches );
 
+  // Compute the points (feature tracks) from all the matches added so far, and store their observations
+  void buildTracks();
+
   cv::Mat intrinsics_matrix_, dist_coeffs_, new_intrinsics_matrix_;
+  std::shared_ptr<ImageUndistorter> undistorter_;
+  std::shared_ptr<FeatureBackend> feature_backend_;
 
-  std::unordered_map<int, int> pose_id_map_;
-  std::unordered_map<uint64_t, int> point_id_map_;
+  TrackBuilder track_builder_;
+  // Image index of each pose
+  std::vector<int> pose_images_;
 
   std::vector<std::string> images_names_;
+  // Keypoints and colors of the images being extracted, moved to keypoints_ once each image is processed
   std::vector< std::vector<cv::KeyPoint> > features_;
   std::vector< std::vector<cv::Vec3b > > feats_colors_;
+  std::vector< KeypointsStore > keypoints_;
   std::vector< cv::Mat > descriptors_;
+  // Per image feature cache files, the descriptors loaded from the cache point inside them
+  std::vector< std::shared_ptr<const MappedFile> > features_files_;
+  // Per image indices of the strongest keypoints (selected while extracting the features), and their
+  // descriptors (only with the coarse verification)
+  std::vector< std::vector<int> > coarse_indices_;
+  std::vector< cv::Mat > coarse_descriptors_;
+  // Per image LSH indices of the descriptors (only with LSH_MATCHING)
+  std::vector< BinaryLshIndex > lsh_indices_;
+
 
+  int num_threads_ = 0;
+  std::string feature_cache_dir_;
+  size_t memory_budget_ = 0;
+  // True after a matching, that releases the descriptors
+  bool features_released_ = false;
+  std::string spill_dir_;
+  std::string vocabulary_filename_;
+  int vocabulary_branching_ = 10, vocabulary_depth_ = 4;
+  UndistortionMode undistortion_mode_ = UNDISTORT_IMAGE;
+  DescriptorMatching descriptor_matching_ = BRUTE_FORCE_MATCHING;
+  BinaryLshIndex::Params lsh_params_;
+  VerificationParams verification_params_;
+  KeypointsSelectionParams keypoints_selection_;
 
   int num_poses_ = 0;
   int num_points_ = 0;
@@ -0,0 +1,238 @@
+#include "hamming_matcher.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAMMING_X86_KERNELS
+#endif
+
+namespace
+{
+  // Number of train descriptors in a tile: the train descriptors of a tile are stored in a
+  // "structure of arrays" layout (64-bit word w of all the descriptors, then word w + 1, ...), so that a
+  // query word can be compared with 4 (AVX2) or 8 (AVX-512) train descriptors with a single instruction.
+  // With 32 bytes ORB descriptors, a tile takes 8 KB, it stays in L1 cache while it is compared with a
+  // whole tile of query descriptors
+  const int train_tile_size = 256;
+  // Number of query descriptors in a tile
+  const int query_tile_size = 512;
+
+  // Compute the distances between a query descriptor (num_words 64-bit words) and the train_tile_size
+  // descriptors of a tile
+  typedef void (*TileDistancesFn)( const uint64_t *query, const uint64_t *tile, int num_words, uint32_t *dists );
+
+  void tileDistancesScalar( const uint64_t *query, const uint64_t *tile, int num_words, uint32_t *dists )
+  {
+    for( int t = 0; t < train_tile_size; t++ )
+      dists[t] = 0;
+    for( int w = 0; w < num_words; w++, tile += train_tile_size )
+    {
+      for( int t = 0; t < train_tile_size; t++ )
+        dists[t] += __builtin_popcountll(query[w] ^ tile[t]);
+    }
+  }
+
+#ifdef HAMMING_X86_KERNELS
+  __attribute__((target("popcnt")))
+  void tileDistancesPopcnt( const uint64_t *query, const uint64_t *tile, int num_words, uint32_t *dists )
+  {
+    for( int t = 0; t < train_tile_size; t++ )
+      dists[t] = 0;
+    for( int w = 0; w < num_words; w++, tile += train_tile_size )
+    {
+      for( int t = 0; t < train_tile_size; t++ )
+        dists[t] += __builtin_popcountll(query[w] ^ tile[t]);
+    }
+  }
+
+  __attribute__((target("avx2")))
+  void tileDistancesAvx2( const uint64_t *query, const uint64_t *tile, int num_words, uint32_t *dists )
+  {
+    // Per-nibble popcount table, used with vpshufb
+    const __m256i lut = _mm256_setr_epi8( 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 ),
+                  low_mask = _mm256_set1_epi8(0x0f), zero = _mm256_setzero_si256(),
+                  // Take the low 32 bits of each 64 bit lane
+                  pack_idx = _mm256_setr_epi32( 0, 2, 4, 6, 0, 2, 4, 6 );
+
+    for( int t = 0; t < train_tile_size; t += 4 )
+    {
+      __m256i sums = zero, byte_counts = zero;
+      for( int w = 0; w < num_words; w++ )
+      {
+        __m256i x = _mm256_xor_si256( _mm256_set1_epi64x(static_cast<long long>(query[w])),
+                                      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tile + w*train_tile_size + t)) );
+        __m256i lo = _mm256_and_si256( x, low_mask ), hi = _mm256_and_si256( _mm256_srli_epi16(x, 4), low_mask );
+        byte_counts = _mm256_add_epi8( byte_counts, _mm256_add_epi8( _mm256_shuffle_epi8(lut, lo),
+                                                                     _mm256_shuffle_epi8(lut, hi) ) );
+        // Each byte counter grows at most by 8 for each word: flush them before they overflow
+        if( w % 31 == 30 )
+        {
+          sums = _mm256_add_epi64( sums, _mm256_sad_epu8(byte_counts, zero) );
+          byte_counts = zero;
+        }
+      }
+      sums = _mm256_add_epi64( sums, _mm256_sad_epu8(byte_counts, zero) );
+      _mm_storeu_si128( reinterpret_cast<__m128i *>(dists + t),
+                        _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(sums, pack_idx)) );
+    }
+  }
+
+  __attribute__((target("avx512f,avx512vpopcntdq")))
+  void tileDistancesAvx512( const uint64_t *query, const uint64_t *tile, int num_words, uint32_t *dists )
+  {
+    for( int t = 0; t < train_tile_size; t += 8 )
+    {
+      __m512i sums = _mm512_setzero_si512();
+      for( int w = 0; w < num_words; w++ )
+      {
+        __m512i x = _mm512_xor_si512( _mm512_set1_epi64(static_cast<long long>(query[w])),
+                                      _mm512_loadu_si512(tile + w*train_tile_size + t) );
+        sums = _mm512_add_epi64( sums, _mm512_popcnt_epi64(x) );
+      }
+      _mm256_storeu_si256( reinterpret_cast<__m256i *>(dists + t), _mm512_cvtepi64_epi32(sums) );
+    }
+  }
+#endif
+
+  struct HammingKernel
+  {
+    TileDistancesFn fn;
+    const char *name;
+  };
+
+  HammingKernel selectKernel()
+  {
+#ifdef HAMMING_X86_KERNELS
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq") )
+      return { tileDistancesAvx512, "AVX-512 VPOPCNTDQ" };
+    if( __builtin_cpu_supports("avx2") )
+      return { tileDistancesAvx2, "AVX2" };
+    if( __builtin_cpu_supports("popcnt") )
+      return { tileDistancesPopcnt, "POPCNT" };
+#endif
+    return { tileDistancesScalar, "scalar" };
+  }
+
+  const HammingKernel &kernel()
+  {
+    static const HammingKernel k = selectKernel();
+    return k;
+  }
+
+  // Copy a descriptor into num_words 64-bit words, zero padded
+  inline void loadWords( const uint8_t *desc, int desc_bytes, uint64_t *words, int num_words )
+  {
+    std::memset( words, 0, num_words*sizeof(uint64_t) );
+    std::memcpy( words, desc, desc_bytes );
+  }
+
+  inline void updateKnn2( Knn2Match &m, int idx, uint32_t dist )
+  {
+    float d = static_cast<float>(dist);
+    if( m.best_idx < 0 || d < m.best_dist )
+    {
+      m.second_idx = m.best_idx;
+      m.second_dist = m.best_dist;
+      m.best_idx = idx;
+      m.best_dist = d;
+    }
+    else if( m.second_idx < 0 || d < m.second_dist )
+    {
+      m.second_idx = idx;
+      m.second_dist = d;
+    }
+  }
+} // namespace
+
+void hammingKnn2( const uint8_t *query, size_t query_step, int num_query,
+                  const uint8_t *train, size_t train_step, int num_train, int desc_bytes,
+                  std::vector<Knn2Match> &matches, std::vector<int> *reverse_best )
+{
+  matches.assign( std::max(num_query, 0), Knn2Match() );
+  if( reverse_best )
+    reverse_best->assign( std::max(num_train, 0), -1 );
+  if( num_query <= 0 || num_train <= 0 || desc_bytes <= 0 )
+    return;
+
+  const int num_words = (desc_bytes + 7)/8,
+            num_tiles = (num_train + train_tile_size - 1)/train_tile_size;
+  const TileDistancesFn tile_distances = kernel().fn;
+
+  // Train descriptors, tile by tile in the structure of arrays layout (the last tile is zero padded)
+  std::vector<uint64_t> train_tiles( static_cast<size_t>(num_tiles)*num_words*train_tile_size, 0 ), words(num_words);
+  for( int i = 0; i < num_train; i++ )
+  {
+    loadWords( train + i*train_step, desc_bytes, words.data(), num_words );
+    uint64_t *tile = train_tiles.data() + static_cast<size_t>(i/train_tile_size)*num_words*train_tile_size;
+    for( int w = 0; w < num_words; w++ )
+      tile[w*train_tile_size + i%train_tile_size] = words[w];
+  }
+
+  std::vector<uint64_t> query_words( static_cast<size_t>(query_tile_size)*num_words );
+  std::vector<uint32_t> reverse_dist( reverse_best ? num_train : 0, UINT_MAX );
+  uint32_t dists[train_tile_size];
+
+  for( int q0 = 0; q0 < num_query; q0 += query_tile_size )
+  {
+    int q1 = std::min( q0 + query_tile_size, num_query );
+    for( int q = q0; q < q1; q++ )
+      loadWords( query + q*query_step, desc_bytes, query_words.data() + (q - q0)*num_words, num_words );
+
+    for( int i_tile = 0; i_tile < num_tiles; i_tile++ )
+    {
+      const uint64_t *tile = train_tiles.data() + static_cast<size_t>(i_tile)*num_words*train_tile_size;
+      int t0 = i_tile*train_tile_size, tile_size = std::min( train_tile_size, num_train - t0 );
+
+      for( int q = q0; q < q1; q++ )
+      {
+        tile_distances( query_words.data() + (q - q0)*num_words, tile, num_words, dists );
+
+        Knn2Match &m = matches[q];
+        // Skip the whole tile if it can't improve the current second best neighbor
+        uint32_t min_dist = *std::min_element( dists, dists + tile_size );
+        if( m.second_idx < 0 || min_dist < m.second_dist )
+        {
+          for( int t = 0; t < tile_size; t++ )
+            updateKnn2( m, t0 + t, dists[t] );
+        }
+
+        if( reverse_best )
+        {
+          for( int t = 0; t < tile_size; t++ )
+          {
+            if( dists[t] < reverse_dist[t0 + t] )
+            {
+              reverse_dist[t0 + t] = dists[t];
+              (*reverse_best)[t0 + t] = q;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+int hammingDistance( const uint8_t *a, const uint8_t *b, int desc_bytes )
+{
+  int dist = 0, i = 0;
+  for( ; i + 8 <= desc_bytes; i += 8 )
+  {
+    uint64_t wa, wb;
+    std::memcpy( &wa, a + i, 8 );
+    std::memcpy( &wb, b + i, 8 );
+    dist += __builtin_popcountll(wa ^ wb);
+  }
+  for( ; i < desc_bytes; i++ )
+    dist += __builtin_popcount(static_cast<unsigned>(a[i] ^ b[i]));
+  return dist;
+}
+
+const char *hammingKernelName()
+{
+  return kernel().name;
+}
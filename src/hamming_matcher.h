@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// The two nearest neighbors of a query descriptor inside a set of train descriptors
+// (the indices are -1 if there are not enough train descriptors)
+struct Knn2Match
+{
+  int best_idx = -1, second_idx = -1;
+  float best_dist = 0, second_dist = 0;
+};
+
+// Brute-force 2-nearest neighbors search of binary descriptors (e.g., ORB) under the Hamming distance.
+// The search is blocked over tiles of query and train descriptors that fit in cache, and the distances are
+// computed with the best instruction set available at runtime (AVX-512 VPOPCNTDQ, AVX2, POPCNT or plain C++).
+// query and train are row-major descriptors matrices of desc_bytes bytes per row, with the given row steps.
+// matches will have num_query elements. If reverse_best is not null, it will be filled with the index of the
+// nearest query descriptor of each train descriptor (-1 if num_query == 0), e.g. to perform cross-checks.
+// In case of ties, the lowest index wins, as in cv::BFMatcher
+void hammingKnn2( const uint8_t *query, size_t query_step, int num_query,
+                  const uint8_t *train, size_t train_step, int num_train, int desc_bytes,
+                  std::vector<Knn2Match> &matches, std::vector<int> *reverse_best = nullptr );
+
+// Same as above, for CV_8U descriptors matrices (e.g., as provided by cv::ORB)
+inline void hammingKnn2( const cv::Mat &query, const cv::Mat &train, std::vector<Knn2Match> &matches,
+                         std::vector<int> *reverse_best = nullptr )
+{
+  CV_Assert( query.empty() || train.empty() || query.cols == train.cols );
+  hammingKnn2( query.data, query.step, query.rows, train.data, train.step, train.rows,
+               query.empty() ? train.cols : query.cols, matches, reverse_best );
+}
+
+// Hamming distance between two single descriptors of desc_bytes bytes
+int hammingDistance( const uint8_t *a, const uint8_t *b, int desc_bytes );
+
+// Name of the instruction set selected at runtime for the distances computation
+const char *hammingKernelName();
@@ -0,0 +1,58 @@
+#include "image_cache.h"
+
+#include <algorithm>
+
+ImageCache::ImageCache( size_t capacity, Loader loader ) :
+  capacity_( std::max<size_t>(capacity, 1) ),
+  loader_(loader)
+{}
+
+std::shared_ptr<const cv::Mat> ImageCache::get( int idx )
+{
+  std::promise< std::shared_ptr<const cv::Mat> > promise;
+  Entry entry;
+  bool miss = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(idx);
+    if( it != entries_.end() )
+    {
+      lru_.splice(lru_.begin(), lru_, it->second.second);
+      entry = it->second.first;
+    }
+    else
+    {
+      miss = true;
+      lru_.push_front(idx);
+      entry = promise.get_future().share();
+      entries_.emplace( idx, std::make_pair(entry, lru_.begin()) );
+      num_loads_++;
+      // The evicted images still being loaded are kept alive by their waiting threads
+      while( entries_.size() > capacity_ )
+      {
+        entries_.erase(lru_.back());
+        lru_.pop_back();
+      }
+    }
+  }
+
+  // Cache miss: load the image outside the lock, the threads requesting it in the meantime wait for it
+  if( miss )
+  {
+    try
+    {
+      promise.set_value( std::make_shared<const cv::Mat>(loader_(idx)) );
+    }
+    catch( ... )
+    {
+      promise.set_exception( std::current_exception() );
+    }
+  }
+  return entry.get();
+}
+
+size_t ImageCache::numLoads() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_loads_;
+}
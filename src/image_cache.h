@@ -0,0 +1,40 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+
+// Least recently used cache of images, indexed by image index, that loads the missing images with the
+// given function (e.g., decoding, undistortion and downscaling). It can be used from multiple threads:
+// an image requested by several threads at once is loaded only once, and the other threads wait for it
+class ImageCache
+{
+ public:
+
+  typedef std::function<cv::Mat( int idx )> Loader;
+
+  // Keep at most capacity images (at least one)
+  ImageCache( size_t capacity, Loader loader );
+
+  // Get the idx-th image, loading it if needed. The returned image stays valid after its eviction
+  std::shared_ptr<const cv::Mat> get( int idx );
+
+  // Number of images loaded so far, i.e., the number of cache misses
+  size_t numLoads() const;
+
+ private:
+
+  typedef std::shared_future< std::shared_ptr<const cv::Mat> > Entry;
+
+  size_t capacity_;
+  Loader loader_;
+  // Most recently used first
+  std::list<int> lru_;
+  std::unordered_map< int, std::pair<Entry, std::list<int>::iterator> > entries_;
+  size_t num_loads_ = 0;
+  mutable std::mutex mutex_;
+};
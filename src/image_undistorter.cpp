@@ -0,0 +1,49 @@
+#include "image_undistorter.h"
+
+ImageUndistorter::ImageUndistorter( cv::Mat intrinsics_matrix, cv::Mat dist_coeffs, cv::Mat new_intrinsics_matrix )
+{
+  intrinsics_matrix_ = intrinsics_matrix.clone();
+  dist_coeffs_ = dist_coeffs.clone();
+  new_intrinsics_matrix_ = new_intrinsics_matrix.clone();
+}
+
+cv::Mat ImageUndistorter::undistort( const cv::Mat &img ) const
+{
+  cv::Mat und_img;
+  if( img.empty() )
+    return und_img;
+
+  auto t = tables(img.size());
+  // Same interpolation and border handling of cv::undistort()
+  cv::remap( img, und_img, t->map1, t->map2, cv::INTER_LINEAR, cv::BORDER_CONSTANT );
+
+  return und_img;
+}
+
+void ImageUndistorter::undistortPoints( std::vector<cv::Point2f> &pts ) const
+{
+  if( pts.empty() )
+    return;
+
+  std::vector<cv::Point2f> und_pts;
+  cv::undistortPoints( pts, und_pts, intrinsics_matrix_, dist_coeffs_, cv::noArray(), new_intrinsics_matrix_ );
+  pts.swap(und_pts);
+}
+
+std::shared_ptr<const ImageUndistorter::RemapTables> ImageUndistorter::tables( const cv::Size &size ) const
+{
+  std::lock_guard<std::mutex> lock(tables_mutex_);
+  for( auto &t : tables_ )
+  {
+    if( t->size == size )
+      return t;
+  }
+
+  auto t = std::make_shared<RemapTables>();
+  t->size = size;
+  cv::initUndistortRectifyMap( intrinsics_matrix_, dist_coeffs_, cv::Mat(), new_intrinsics_matrix_,
+                               size, CV_16SC2, t->map1, t->map2 );
+  tables_.push_back(t);
+
+  return t;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Undistort images by means of precomputed remap tables. The tables are built only once for each
+// image size (i.e., for each calibration) in a compact fixed-point format, and they are then shared by
+// all the users of the object (it can be safely used from multiple threads)
+class ImageUndistorter
+{
+ public:
+
+  // Constructor: it requires the camera intrinsics matrix, its distortion coefficients and the intrinsics
+  // matrix of the undistorted images
+  ImageUndistorter( cv::Mat intrinsics_matrix, cv::Mat dist_coeffs, cv::Mat new_intrinsics_matrix );
+
+  // Undistort an image, the result is the same as cv::undistort() but the tables are not recomputed
+  cv::Mat undistort( const cv::Mat &img ) const;
+
+  // Undistort (in place) a set of point coordinates from the raw image frame to the frame of the undistorted
+  // images, i.e., the one defined by new_intrinsics_matrix
+  void undistortPoints( std::vector<cv::Point2f> &pts ) const;
+
+  const cv::Mat &intrinsicsMatrix() const { return intrinsics_matrix_; };
+  const cv::Mat &distCoeffs() const { return dist_coeffs_; };
+  const cv::Mat &newIntrinsicsMatrix() const { return new_intrinsics_matrix_; };
+
+ private:
+
+  struct RemapTables
+  {
+    cv::Size size;
+    cv::Mat map1, map2;
+  };
+
+  // Get the remap tables for images of the given size, building them if needed: map1 is a CV_16SC2 table of
+  // integer coordinates, map2 a CV_16UC1 table of interpolation coefficients
+  std::shared_ptr<const RemapTables> tables( const cv::Size &size ) const;
+
+  cv::Mat intrinsics_matrix_, dist_coeffs_, new_intrinsics_matrix_;
+
+  // One set of tables for each image size seen so far (usually just one)
+  mutable std::mutex tables_mutex_;
+  mutable std::vector< std::shared_ptr<const RemapTables> > tables_;
+};
@@ -1,7 +1,13 @@
 #include "io_utils.h"
 
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
 
@@ -9,6 +15,29 @@ using namespace std;
 using namespace boost;
 using namespace boost::filesystem;
 
+namespace
+{
+  const char data_file_magic[8] = { 'S', 'F', 'M', 'D', 'A', 'T', 'A', '\0' };
+  const uint32_t data_file_version = 1;
+  const uint64_t data_file_alignment = 64;
+
+  struct DataFileHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int32_t num_poses, num_points, num_observations, num_parameters;
+    // Offsets of the arrays (0 for the missing optional ones)
+    uint64_t pose_index_offset, point_index_offset, observations_offset, colors_offset, parameters_offset;
+    uint64_t file_size;
+  };
+
+  uint64_t alignOffset( uint64_t offset )
+  {
+    return (offset + data_file_alignment - 1)/data_file_alignment*data_file_alignment;
+  }
+} // namespace
+
 bool loadCameraParams( const std::string &file_name, cv::Size &image_size,
                        cv::Mat &camera_matrix, cv::Mat &dist_coeffs )
 {
@@ -44,3 +73,215 @@ bool readFileNamesFromFolder ( const string& input_folder_name, vector< string >
     return false;
   }
 }
+
+bool MappedFile::open( const std::string &filename )
+{
+  close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if( fd < 0 )
+    return false;
+
+  struct stat st;
+  if( fstat(fd, &st) != 0 || st.st_size <= 0 )
+  {
+    ::close(fd);
+    return false;
+  }
+
+  void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after closing the file descriptor
+  ::close(fd);
+  if( ptr == MAP_FAILED )
+    return false;
+
+  data_ = static_cast<uint8_t *>(ptr);
+  size_ = st.st_size;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if( data_ )
+    munmap(data_, size_);
+  data_ = nullptr;
+  size_ = 0;
+}
+
+void MappedFile::advise( const void *data, size_t size, bool will_need ) const
+{
+  const uint8_t *begin = static_cast<const uint8_t *>(data), *end = begin + size;
+  if( !data_ || begin < data_ || end > data_ + size_ || begin >= end )
+    return;
+
+  // madvise() works on whole pages: the read ahead may cover some more bytes, while the released pages
+  // must be fully inside the range (the pages shared with the neighboring data are kept)
+  const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t page_begin = reinterpret_cast<uintptr_t>(begin), page_end = reinterpret_cast<uintptr_t>(end);
+  if( will_need )
+  {
+    page_begin = page_begin/page_size*page_size;
+    page_end = std::min( (page_end + page_size - 1)/page_size*page_size,
+                         reinterpret_cast<uintptr_t>(data_ + size_) );
+  }
+  else
+  {
+    page_begin = (page_begin + page_size - 1)/page_size*page_size;
+    page_end = page_end/page_size*page_size;
+  }
+  if( page_begin < page_end )
+    madvise( reinterpret_cast<void *>(page_begin), page_end - page_begin,
+             will_need ? MADV_WILLNEED : MADV_DONTNEED );
+}
+
+uint64_t hashBytes( const void *data, size_t size, uint64_t hash )
+{
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for( size_t i = 0; i < size; i++ )
+  {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool hashFileContent( const std::string &filename, uint64_t &hash )
+{
+  MappedFile file;
+  if( !file.open(filename) )
+    return false;
+
+  hash = hashBytes( file.data(), file.size() );
+  return true;
+}
+
+bool BinaryDataFile::write( const std::string &filename, int num_poses, int num_points, int num_observations,
+                            const int *pose_index, const int *point_index, const double *observations,
+                            const unsigned char *colors, int num_parameters, const double *parameters )
+{
+  DataFileHeader header;
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, data_file_magic, sizeof(data_file_magic) );
+  header.version = data_file_version;
+  header.num_poses = num_poses;
+  header.num_points = num_points;
+  header.num_observations = num_observations;
+  header.num_parameters = parameters ? num_parameters : 0;
+
+  // Arrays sizes in bytes, computed in 64 bits
+  const uint64_t index_size = static_cast<uint64_t>(num_observations)*sizeof(int32_t),
+                 observations_size = 2*static_cast<uint64_t>(num_observations)*sizeof(double),
+                 colors_size = 3*static_cast<uint64_t>(num_points),
+                 parameters_size = static_cast<uint64_t>(header.num_parameters)*sizeof(double);
+
+  uint64_t offset = alignOffset(sizeof(header));
+  header.pose_index_offset = offset;
+  offset = alignOffset(offset + index_size);
+  header.point_index_offset = offset;
+  offset = alignOffset(offset + index_size);
+  header.observations_offset = offset;
+  offset += observations_size;
+  if( colors )
+  {
+    offset = alignOffset(offset);
+    header.colors_offset = offset;
+    offset += colors_size;
+  }
+  if( header.num_parameters )
+  {
+    offset = alignOffset(offset);
+    header.parameters_offset = offset;
+    offset += parameters_size;
+  }
+  header.file_size = offset;
+
+  FILE* fptr = fopen(filename.c_str(), "wb");
+
+  if (fptr == NULL) {
+    cerr << "Error: unable to open file " << filename;
+    return false;
+  };
+
+  static const char zeros[data_file_alignment] = {};
+  uint64_t written = 0;
+  auto writeAt = [&]( uint64_t at, const void *data, uint64_t size )
+  {
+    if( fwrite(zeros, 1, at - written, fptr) != at - written || fwrite(data, 1, size, fptr) != size )
+      return false;
+    written = at + size;
+    return true;
+  };
+
+  static_assert( sizeof(int) == sizeof(int32_t), "int is expected to be 32 bits" );
+  bool ok = writeAt( 0, &header, sizeof(header) ) &&
+            writeAt( header.pose_index_offset, pose_index, index_size ) &&
+            writeAt( header.point_index_offset, point_index, index_size ) &&
+            writeAt( header.observations_offset, observations, observations_size );
+  if( ok && colors )
+    ok = writeAt( header.colors_offset, colors, colors_size );
+  if( ok && header.num_parameters )
+    ok = writeAt( header.parameters_offset, parameters, parameters_size );
+
+  ok = (fclose(fptr) == 0) && ok;
+  if( !ok )
+    cerr << "Error: unable to write file " << filename;
+  return ok;
+}
+
+bool BinaryDataFile::isBinaryDataFile( const std::string &filename )
+{
+  FILE* fptr = fopen(filename.c_str(), "rb");
+  if (fptr == NULL)
+    return false;
+
+  char magic[sizeof(data_file_magic)];
+  bool is_binary = fread(magic, 1, sizeof(magic), fptr) == sizeof(magic) &&
+                   memcmp(magic, data_file_magic, sizeof(magic)) == 0;
+  fclose(fptr);
+  return is_binary;
+}
+
+bool BinaryDataFile::open( const std::string &filename )
+{
+  if( !file_.open(filename) || file_.size() < sizeof(DataFileHeader) )
+    return false;
+
+  DataFileHeader header;
+  memcpy( &header, file_.data(), sizeof(header) );
+
+  // Arrays sizes in bytes, computed in 64 bits (only used once the counts are known to be non negative)
+  const uint64_t index_size = static_cast<uint64_t>(header.num_observations)*sizeof(int32_t),
+                 observations_size = 2*static_cast<uint64_t>(header.num_observations)*sizeof(double),
+                 colors_size = 3*static_cast<uint64_t>(header.num_points),
+                 parameters_size = static_cast<uint64_t>(header.num_parameters)*sizeof(double);
+
+  // Written so that offset + size can not overflow
+  auto inFile = [&]( uint64_t offset, uint64_t size )
+  {
+    return offset % data_file_alignment == 0 && offset <= file_.size() && size <= file_.size() - offset;
+  };
+
+  if( memcmp(header.magic, data_file_magic, sizeof(data_file_magic)) != 0 ||
+      header.version != data_file_version || header.file_size != file_.size() ||
+      header.num_poses < 0 || header.num_points < 0 || header.num_observations < 0 || header.num_parameters < 0 ||
+      !inFile(header.pose_index_offset, index_size) || !inFile(header.point_index_offset, index_size) ||
+      !inFile(header.observations_offset, observations_size) ||
+      (header.colors_offset && !inFile(header.colors_offset, colors_size)) ||
+      (header.num_parameters && !inFile(header.parameters_offset, parameters_size)) )
+  {
+    cerr << "Error: invalid binary data file " << filename << endl;
+    file_.close();
+    return false;
+  }
+
+  num_poses_ = header.num_poses;
+  num_points_ = header.num_points;
+  num_observations_ = header.num_observations;
+  num_parameters_ = header.num_parameters;
+  pose_index_ = reinterpret_cast<const int32_t *>(file_.data() + header.pose_index_offset);
+  point_index_ = reinterpret_cast<const int32_t *>(file_.data() + header.point_index_offset);
+  observations_ = reinterpret_cast<const double *>(file_.data() + header.observations_offset);
+  colors_ = header.colors_offset ? file_.data() + header.colors_offset : nullptr;
+  parameters_ = header.num_parameters ? reinterpret_cast<const double *>(file_.data() + header.parameters_offset) : nullptr;
+  return true;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <opencv2/opencv.hpp>
@@ -7,3 +9,81 @@
 bool readFileNamesFromFolder ( const std::string& input_folder_name, std::vector< std::string >& names );
 bool loadCameraParams( const std::string &file_name, cv::Size &image_size,
                        cv::Mat &camera_matrix, cv::Mat &dist_coeffs );
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+ public:
+
+  MappedFile() = default;
+  ~MappedFile() { close(); };
+
+  MappedFile( const MappedFile & ) = delete;
+  MappedFile &operator=( const MappedFile & ) = delete;
+
+  // Map the file, return false on failure
+  bool open( const std::string &filename );
+  void close();
+
+  bool isOpen() const { return data_ != nullptr; };
+  const uint8_t *data() const { return data_; };
+  size_t size() const { return size_; };
+
+  // Hint the kernel that the size bytes starting at data (inside the mapping) will be accessed soon, so their
+  // pages are read ahead asynchronously (will_need = true), or that they are not needed anymore, so their
+  // pages are released and read again from the file only if accessed later (will_need = false)
+  void advise( const void *data, size_t size, bool will_need ) const;
+
+ private:
+
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// 64 bits FNV-1a hash of a memory buffer, hash is the initial value (used to combine several hashes)
+uint64_t hashBytes( const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL );
+
+// Hash of the content of a file, return false if the file can't be read
+bool hashFileContent( const std::string &filename, uint64_t &hash );
+
+// Binary, memory mappable version of the data file produced by the matcher and read by basic_sfm
+// (the text format is "num_poses num_points num_observations", one "pose point x y" line per observation,
+// then the optional points colors and parameters). The binary file has a versioned header, followed by the
+// observations pose indices, point indices and coordinates as contiguous 64-byte aligned arrays, then by
+// the optional RGB colors (3 bytes per point) and parameters (doubles)
+class BinaryDataFile
+{
+ public:
+
+  // Write a binary data file, colors and parameters can be null. Return false on failure
+  static bool write( const std::string &filename, int num_poses, int num_points, int num_observations,
+                     const int *pose_index, const int *point_index, const double *observations,
+                     const unsigned char *colors = nullptr, int num_parameters = 0,
+                     const double *parameters = nullptr );
+
+  // Check if a file starts with the binary data file magic
+  static bool isBinaryDataFile( const std::string &filename );
+
+  // Map a binary data file and validate its header, return false on failure
+  bool open( const std::string &filename );
+
+  int numPoses() const { return num_poses_; };
+  int numPoints() const { return num_points_; };
+  int numObservations() const { return num_observations_; };
+  int numParameters() const { return num_parameters_; };
+
+  // Pointers to the arrays inside the mapped file (colors and parameters are null if not available)
+  const int32_t *poseIndex() const { return pose_index_; };
+  const int32_t *pointIndex() const { return point_index_; };
+  const double *observations() const { return observations_; };
+  const unsigned char *colors() const { return colors_; };
+  const double *parameters() const { return parameters_; };
+
+ private:
+
+  MappedFile file_;
+  int num_poses_ = 0, num_points_ = 0, num_observations_ = 0, num_parameters_ = 0;
+  const int32_t *pose_index_ = nullptr, *point_index_ = nullptr;
+  const double *observations_ = nullptr, *parameters_ = nullptr;
+  const unsigned char *colors_ = nullptr;
+};
@@ -0,0 +1,131 @@
+#include "keypoints_selection.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace
+{
+  // Indices of the keypoints with the num_max strongest responses, sorted by decreasing response
+  // (ties broken by index)
+  void strongestKeypoints( const std::vector<cv::KeyPoint> &keypoints, std::vector<int> &indices, size_t num_max )
+  {
+    auto stronger = [&keypoints]( int i0, int i1 )
+    {
+      return keypoints[i0].response > keypoints[i1].response ||
+             (keypoints[i0].response == keypoints[i1].response && i0 < i1);
+    };
+    if( indices.size() > num_max )
+    {
+      std::nth_element(indices.begin(), indices.begin() + num_max, indices.end(), stronger);
+      indices.resize(num_max);
+    }
+    std::sort(indices.begin(), indices.end(), stronger);
+  }
+
+  // Greedy square covering: visit the keypoints by decreasing response, keep a keypoint if its cell is not
+  // covered yet, and cover all the cells within width from it
+  void squareCovering( const std::vector<cv::KeyPoint> &keypoints, const std::vector<int> &sorted_indices,
+                       cv::Size image_size, int width, std::vector<int> &selected )
+  {
+    selected.clear();
+    double c = std::max(width/2.0, 1.0);
+    int num_cell_cols = static_cast<int>(image_size.width/c) + 1, num_cell_rows = static_cast<int>(image_size.height/c) + 1,
+        cover = static_cast<int>(std::floor(width/c));
+    std::vector<char> covered(static_cast<size_t>(num_cell_cols)*num_cell_rows, 0);
+    for( int idx : sorted_indices )
+    {
+      const cv::Point2f &pt = keypoints[idx].pt;
+      int col = std::min(std::max(static_cast<int>(pt.x/c), 0), num_cell_cols - 1),
+          row = std::min(std::max(static_cast<int>(pt.y/c), 0), num_cell_rows - 1);
+      if( covered[row*num_cell_cols + col] )
+        continue;
+      selected.push_back(idx);
+      for( int r = std::max(row - cover, 0); r <= std::min(row + cover, num_cell_rows - 1); r++ )
+        std::fill( covered.begin() + r*num_cell_cols + std::max(col - cover, 0),
+                   covered.begin() + r*num_cell_cols + std::min(col + cover, num_cell_cols - 1) + 1, 1 );
+    }
+  }
+} // namespace
+
+void selectKeypoints( std::vector<cv::KeyPoint> &keypoints, cv::Size image_size,
+                      const KeypointsSelectionParams &params )
+{
+  const int num_ret = params.max_keypoints;
+  if( num_ret <= 0 || keypoints.empty() )
+    return;
+
+  // Per cell caps
+  const int grid_cols = std::max(params.grid_cols, 1), grid_rows = std::max(params.grid_rows, 1);
+  int max_per_cell = params.max_keypoints_per_cell;
+  if( max_per_cell <= 0 )
+    max_per_cell = std::max(2*num_ret/(grid_cols*grid_rows), 1);
+
+  std::vector< std::vector<int> > cells(grid_cols*grid_rows);
+  for( int i = 0; i < static_cast<int>(keypoints.size()); i++ )
+  {
+    const cv::Point2f &pt = keypoints[i].pt;
+    int col = std::min(std::max(static_cast<int>(pt.x*grid_cols/image_size.width), 0), grid_cols - 1),
+        row = std::min(std::max(static_cast<int>(pt.y*grid_rows/image_size.height), 0), grid_rows - 1);
+    cells[row*grid_cols + col].push_back(i);
+  }
+  std::vector<int> sorted_indices;
+  for( auto &cell : cells )
+  {
+    strongestKeypoints(keypoints, cell, max_per_cell);
+    sorted_indices.insert(sorted_indices.end(), cell.begin(), cell.end());
+  }
+  strongestKeypoints(keypoints, sorted_indices, sorted_indices.size());
+
+  std::vector<int> selected;
+  if( static_cast<int>(sorted_indices.size()) <= num_ret || num_ret == 1 )
+  {
+    selected.assign(sorted_indices.begin(), sorted_indices.begin() + std::min<size_t>(num_ret, sorted_indices.size()));
+  }
+  else
+  {
+    // Binary search of the covering width that selects about num_ret keypoints (the initial upper bound is
+    // the one derived in the paper)
+    const double n = static_cast<double>(sorted_indices.size()), rows = image_size.height, cols = image_size.width,
+                 exp1 = rows + cols + 2*num_ret,
+                 exp2 = 4*cols + 4*num_ret + 4*rows*num_ret + rows*rows + cols*cols - 2*rows*cols + 4*rows*cols*num_ret,
+                 exp3 = std::sqrt(exp2), exp4 = num_ret - 1;
+    int high = static_cast<int>(std::max(-std::round((exp1 + exp3)/exp4), -std::round((exp1 - exp3)/exp4))),
+        low = static_cast<int>(std::floor(std::sqrt(n/num_ret)));
+    low = std::max(low, 1);
+    high = std::max(high, low);
+    const int tolerance = std::max(num_ret/10, 1);
+
+    std::vector<int> result;
+    int prev_width = -1;
+    while( low <= high )
+    {
+      int width = low + (high - low)/2;
+      if( width == prev_width )
+        break;
+      squareCovering(keypoints, sorted_indices, image_size, width, result);
+      // Keep the smallest selection that is not below the target or, if there is none, the largest one
+      bool result_enough = static_cast<int>(result.size()) >= num_ret,
+           selected_enough = static_cast<int>(selected.size()) >= num_ret;
+      if( selected.empty() || (result_enough && (!selected_enough || result.size() < selected.size())) ||
+          (!result_enough && !selected_enough && result.size() > selected.size()) )
+        selected = result;
+      if( static_cast<int>(result.size()) >= num_ret - tolerance &&
+          static_cast<int>(result.size()) <= num_ret + tolerance )
+        break;
+      if( static_cast<int>(result.size()) < num_ret )
+        high = width - 1;
+      else
+        low = width + 1;
+      prev_width = width;
+    }
+    if( static_cast<int>(selected.size()) > num_ret )
+      selected.resize(num_ret);
+  }
+
+  std::vector<cv::KeyPoint> selected_keypoints;
+  selected_keypoints.reserve(selected.size());
+  for( int idx : selected )
+    selected_keypoints.push_back(keypoints[idx]);
+  keypoints.swap(selected_keypoints);
+}
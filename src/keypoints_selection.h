@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Parameters of the spatial selection of the keypoints provided by a detector
+struct KeypointsSelectionParams
+{
+  // Total number of keypoints kept in each image (0 disables the selection)
+  int max_keypoints = 0;
+  // The image is divided in grid_cols x grid_rows cells, and each cell keeps at most max_keypoints_per_cell
+  // of its strongest keypoints (0 means twice the cell share of max_keypoints)
+  int grid_cols = 8, grid_rows = 8;
+  int max_keypoints_per_cell = 0;
+};
+
+// Select (in place) up to params.max_keypoints keypoints evenly distributed over an image of the given size:
+// after the per cell caps, keypoints are chosen by adaptive non-maximal suppression, i.e., the strongest
+// keypoints (by response) that are not too close to each other, with the suppression radius set to obtain
+// about max_keypoints keypoints, see:
+// O. Bailo et al., "Efficient adaptive non-maximal suppression algorithms for homogeneous spatial keypoint
+// distribution" (Suppression via Square Covering)
+// Selected keypoints are sorted by decreasing response, the result does not depend on the input order
+// of keypoints with different responses
+void selectKeypoints( std::vector<cv::KeyPoint> &keypoints, cv::Size image_size,
+                      const KeypointsSelectionParams &params );
@@ -0,0 +1,67 @@
+#include "keypoints_store.h"
+
+#include <algorithm>
+
+void KeypointsStore::assign( const std::vector<cv::KeyPoint> &keypoints, const std::vector<cv::Vec3b> &colors )
+{
+  CV_Assert( colors.size() == keypoints.size() );
+  clear();
+  num_keypoints_ = static_cast<int>(keypoints.size());
+  x_.resize(num_keypoints_);
+  y_.resize(num_keypoints_);
+  colors_.assign(colors.begin(), colors.end());
+  for( int k = 0; k < num_keypoints_; k++ )
+  {
+    x_[k] = keypoints[k].pt.x;
+    y_[k] = keypoints[k].pt.y;
+  }
+}
+
+void KeypointsStore::retain( const std::vector<char> &keep )
+{
+  CV_Assert( static_cast<int>(keep.size()) == num_keypoints_ );
+  // Compact the arrays in place, the positions of the kept keypoints are never after their old ones
+  std::vector<int> ids;
+  size_t num_kept = 0;
+  for( size_t pos = 0; pos < x_.size(); pos++ )
+  {
+    int idx = ids_.empty() ? static_cast<int>(pos) : ids_[pos];
+    if( !keep[idx] )
+      continue;
+    ids.push_back(idx);
+    x_[num_kept] = x_[pos];
+    y_[num_kept] = y_[pos];
+    colors_[num_kept] = colors_[pos];
+    num_kept++;
+  }
+
+  // Release the memory: shrinking to a fresh vector, since shrink_to_fit() is only a request
+  auto shrink = [num_kept]( auto &v )
+  {
+    v.resize( std::min(v.size(), num_kept) );
+    std::remove_reference_t<decltype(v)>(v.begin(), v.end()).swap(v);
+  };
+  shrink(x_);
+  shrink(y_);
+  shrink(colors_);
+  // Without released keypoints, ids_ is empty (i.e., the identity)
+  if( static_cast<int>(num_kept) == num_keypoints_ )
+    std::vector<int>().swap(ids_);
+  else
+    ids_.swap(ids);
+}
+
+void KeypointsStore::clear()
+{
+  num_keypoints_ = 0;
+  std::vector<int>().swap(ids_);
+  std::vector<float>().swap(x_);
+  std::vector<float>().swap(y_);
+  std::vector<cv::Vec3b>().swap(colors_);
+}
+
+size_t KeypointsStore::memoryBytes() const
+{
+  return ids_.capacity()*sizeof(int) + (x_.capacity() + y_.capacity())*sizeof(float) +
+         colors_.capacity()*sizeof(cv::Vec3b);
+}
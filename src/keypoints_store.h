@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Compact storage of the keypoints of an image, as a structure of arrays: the coordinates and the color of
+// each keypoint (11 bytes, against the 28 bytes of a cv::KeyPoint plus its color). The scale, orientation,
+// response, octave and class id are not stored.
+// Keypoints are accessed by their index in the original vector, also after retain() has released some of them
+class KeypointsStore
+{
+ public:
+
+  // Store the keypoints and their colors (one per keypoint)
+  void assign( const std::vector<cv::KeyPoint> &keypoints, const std::vector<cv::Vec3b> &colors );
+
+  // Number of keypoints, including the released ones
+  int size() const { return num_keypoints_; };
+  bool empty() const { return num_keypoints_ == 0; };
+
+  // Access to the idx-th keypoint, that must not have been released
+  cv::Point2f point( int idx ) const
+  {
+    int pos = position(idx);
+    return cv::Point2f(x_[pos], y_[pos]);
+  };
+  cv::Vec3b color( int idx ) const { return colors_[position(idx)]; };
+
+  // Coordinates arrays, only while all the keypoints are stored
+  const float *x() const { return x_.data(); };
+  const float *y() const { return y_.data(); };
+
+  // Keep only the keypoints with keep[idx] != 0 (e.g., the matched ones), and release the memory of the
+  // others. The kept keypoints are still accessed by their original index
+  void retain( const std::vector<char> &keep );
+
+  void clear();
+
+  // Memory used by the store, in bytes
+  size_t memoryBytes() const;
+
+ private:
+
+  // Position of the idx-th keypoint inside the arrays
+  int position( int idx ) const
+  {
+    if( ids_.empty() )
+    {
+      CV_DbgAssert( idx >= 0 && idx < static_cast<int>(x_.size()) );
+      return idx;
+    }
+    auto it = std::lower_bound(ids_.begin(), ids_.end(), idx);
+    CV_DbgAssert( it != ids_.end() && *it == idx );
+    return static_cast<int>(it - ids_.begin());
+  };
+
+  int num_keypoints_ = 0;
+  // Original indices of the stored keypoints, in increasing order (empty if all or none of the keypoints
+  // are stored)
+  std::vector<int> ids_;
+  std::vector<float> x_, y_;
+  std::vector<cv::Vec3b> colors_;
+};
@@ -0,0 +1,119 @@
+#include "l2_matcher.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+  // Blocks of query x train descriptors whose distances are computed by a single matrix product
+  // (the distances block is 1 MB)
+  const int query_block_size = 128;
+  const int train_block_size = 2048;
+} // namespace
+
+L2GemmDescriptors::L2GemmDescriptors( const cv::Mat &descriptors )
+{
+  CV_Assert( descriptors.empty() || descriptors.type() == CV_8U );
+  this->descriptors.resize(descriptors.rows, descriptors.cols);
+  for( int r = 0; r < descriptors.rows; r++ )
+  {
+    const uint8_t *desc = descriptors.ptr<uint8_t>(r);
+    for( int c = 0; c < descriptors.cols; c++ )
+      this->descriptors(r, c) = desc[c];
+  }
+  sq_norms = this->descriptors.rowwise().squaredNorm();
+}
+
+void l2Knn2Gemm( const L2GemmDescriptors &query, const L2GemmDescriptors &train, std::vector<Knn2Match> &matches,
+                 std::vector<int> *reverse_best )
+{
+  const int num_query = query.size(), num_train = train.size();
+  matches.assign( num_query, Knn2Match() );
+  std::vector<float> reverse_dist;
+  if( reverse_best )
+  {
+    reverse_best->assign( num_train, -1 );
+    reverse_dist.resize(num_train);
+  }
+  if( !num_query || !num_train )
+    return;
+  CV_Assert( query.descriptors.cols() == train.descriptors.cols() );
+
+  // Ranking distances of the neighbors: |t|^2 - 2*q*t^T, i.e., the squared distances without the constant
+  // |q|^2 term (all exact integers)
+  std::vector<float> best(num_query, std::numeric_limits<float>::max()),
+                     second(num_query, std::numeric_limits<float>::max());
+  Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> dots;
+  std::vector<float> row_dists(train_block_size);
+
+  // Train blocks in the outer loop: for each query, train descriptors are visited by increasing index, so
+  // strict comparisons keep the lowest index in case of ties (and vice versa for the reverse matches)
+  for( int t0 = 0; t0 < num_train; t0 += train_block_size )
+  {
+    const int nt = std::min(train_block_size, num_train - t0);
+    const float *t_sq_norms = train.sq_norms.data() + t0;
+    for( int q0 = 0; q0 < num_query; q0 += query_block_size )
+    {
+      const int nq = std::min(query_block_size, num_query - q0);
+      dots.noalias() = query.descriptors.middleRows(q0, nq)*train.descriptors.middleRows(t0, nt).transpose();
+
+      for( int qi = 0; qi < nq; qi++ )
+      {
+        const int q = q0 + qi;
+        const float *q_dots = dots.data() + static_cast<size_t>(qi)*nt;
+        float *dists = row_dists.data();
+        for( int ti = 0; ti < nt; ti++ )
+          dists[ti] = t_sq_norms[ti] - 2*q_dots[ti];
+
+        // Top 2 scan: after the first few descriptors, the branch is rarely taken
+        Knn2Match &m = matches[q];
+        float best_dist = best[q], second_dist = second[q];
+        for( int ti = 0; ti < nt; ti++ )
+        {
+          float dist = dists[ti];
+          if( dist < second_dist )
+          {
+            if( dist < best_dist )
+            {
+              m.second_idx = m.best_idx;
+              second_dist = best_dist;
+              m.best_idx = t0 + ti;
+              best_dist = dist;
+            }
+            else
+            {
+              m.second_idx = t0 + ti;
+              second_dist = dist;
+            }
+          }
+        }
+        best[q] = best_dist;
+        second[q] = second_dist;
+
+        if( reverse_best )
+        {
+          const float q_sq_norm = query.sq_norms[q];
+          int *rev_best = reverse_best->data() + t0;
+          float *rev_dist = reverse_dist.data() + t0;
+          // Branchless, so that the compiler can vectorize it
+          for( int ti = 0; ti < nt; ti++ )
+          {
+            float dist = q_sq_norm + dists[ti];
+            bool better = rev_best[ti] < 0 || dist < rev_dist[ti];
+            rev_dist[ti] = better ? dist : rev_dist[ti];
+            rev_best[ti] = better ? q : rev_best[ti];
+          }
+        }
+      }
+    }
+  }
+
+  for( int q = 0; q < num_query; q++ )
+  {
+    if( matches[q].best_idx >= 0 )
+      matches[q].best_dist = std::sqrt(std::max(best[q] + query.sq_norms[q], 0.0f));
+    if( matches[q].second_idx >= 0 )
+      matches[q].second_dist = std::sqrt(std::max(second[q] + query.sq_norms[q], 0.0f));
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <vector>
+#include <Eigen/Core>
+#include <opencv2/opencv.hpp>
+
+#include "hamming_matcher.h"
+
+// Descriptors prepared for l2Knn2Gemm(): converted to float once (e.g., once for all the pairs of a tile
+// of images), together with their squared norms
+struct L2GemmDescriptors
+{
+  Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> descriptors;
+  Eigen::VectorXf sq_norms;
+
+  // Prepare a matrix of CV_8U descriptors (one per row, e.g., SIFT)
+  explicit L2GemmDescriptors( const cv::Mat &descriptors );
+
+  int size() const { return static_cast<int>(descriptors.rows()); };
+};
+
+// Brute-force 2-nearest neighbors search under the L2 distance, with the same semantics of hammingKnn2().
+// The squared distances of blocks of query and train descriptors are computed at once as
+// |q|^2 + |t|^2 - 2*q*t^T, where q*t^T is a matrix product (GEMM) performed by Eigen. For descriptors with
+// integer values in [0, 255] and up to 128 elements (e.g., SIFT) all the values involved are integers
+// below 2^24, so the distances are exact in single precision and the results are the same of
+// cv::BFMatcher(cv::NORM_L2)
+void l2Knn2Gemm( const L2GemmDescriptors &query, const L2GemmDescriptors &train, std::vector<Knn2Match> &matches,
+                 std::vector<int> *reverse_best = nullptr );
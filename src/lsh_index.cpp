@@ -0,0 +1,130 @@
+#include "lsh_index.h"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+
+void BinaryLshIndex::clear()
+{
+  descriptors_.release();
+  tables_.clear();
+}
+
+uint32_t BinaryLshIndex::hashKey( const HashTable &table, const uint8_t *desc ) const
+{
+  uint32_t key = 0;
+  for( int k = 0; k < static_cast<int>(table.bits.size()); k++ )
+  {
+    int b = table.bits[k];
+    key |= static_cast<uint32_t>((desc[b >> 3] >> (b & 7)) & 1) << k;
+  }
+  return key;
+}
+
+void BinaryLshIndex::build( const cv::Mat &descriptors, const Params &params )
+{
+  clear();
+  if( descriptors.empty() )
+    return;
+
+  params_ = params;
+  descriptors_ = descriptors;
+
+  int num_bits = descriptors.cols*8,
+      key_bits = std::min( std::max(params.key_bits, 1), std::min(num_bits, 30) );
+
+  std::vector<int> all_bits(num_bits);
+  std::iota(all_bits.begin(), all_bits.end(), 0);
+
+  tables_.resize( std::max(params.num_tables, 1) );
+  for( int t = 0; t < static_cast<int>(tables_.size()); t++ )
+  {
+    HashTable &table = tables_[t];
+
+    // Deterministic choice of the sampled bits, the same for every image
+    std::mt19937 rng(t);
+    std::shuffle(all_bits.begin(), all_bits.end(), rng);
+    table.bits.assign(all_bits.begin(), all_bits.begin() + key_bits);
+
+    std::vector< std::pair<uint32_t, int> > entries(descriptors.rows);
+    for( int r = 0; r < descriptors.rows; r++ )
+      entries[r] = std::make_pair( hashKey(table, descriptors.ptr<uint8_t>(r)), r );
+    std::sort(entries.begin(), entries.end());
+
+    table.keys.resize(entries.size());
+    table.indices.resize(entries.size());
+    for( size_t k = 0; k < entries.size(); k++ )
+    {
+      table.keys[k] = entries[k].first;
+      table.indices[k] = entries[k].second;
+    }
+  }
+}
+
+void BinaryLshIndex::knn2( const cv::Mat &queries, std::vector<Knn2Match> &matches ) const
+{
+  matches.assign( queries.rows, Knn2Match() );
+  if( empty() || queries.empty() )
+    return;
+
+  const int desc_bytes = descriptors_.cols;
+  // Last query that visited each descriptor, to compute each distance only once per query
+  std::vector<int> visited(descriptors_.rows, -1);
+  std::vector<uint32_t> probes;
+
+  for( int q = 0; q < queries.rows; q++ )
+  {
+    const uint8_t *query = queries.ptr<uint8_t>(q);
+    Knn2Match &m = matches[q];
+
+    auto update = [&]( int idx, float dist )
+    {
+      // Candidates are not visited in index order: ties are broken by index as in the exhaustive search
+      if( m.best_idx < 0 || dist < m.best_dist || (dist == m.best_dist && idx < m.best_idx) )
+      {
+        m.second_idx = m.best_idx;
+        m.second_dist = m.best_dist;
+        m.best_idx = idx;
+        m.best_dist = dist;
+      }
+      else if( m.second_idx < 0 || dist < m.second_dist || (dist == m.second_dist && idx < m.second_idx) )
+      {
+        m.second_idx = idx;
+        m.second_dist = dist;
+      }
+    };
+
+    for( auto &table : tables_ )
+    {
+      uint32_t key = hashKey(table, query);
+      int key_bits = static_cast<int>(table.bits.size());
+
+      probes.assign(1, key);
+      if( params_.probe_level >= 1 )
+      {
+        for( int b0 = 0; b0 < key_bits; b0++ )
+        {
+          probes.push_back( key ^ (1u << b0) );
+          if( params_.probe_level >= 2 )
+          {
+            for( int b1 = b0 + 1; b1 < key_bits; b1++ )
+              probes.push_back( key ^ (1u << b0) ^ (1u << b1) );
+          }
+        }
+      }
+
+      for( auto probe : probes )
+      {
+        auto range = std::equal_range(table.keys.begin(), table.keys.end(), probe);
+        for( auto it = range.first; it != range.second; ++it )
+        {
+          int idx = table.indices[it - table.keys.begin()];
+          if( visited[idx] == q )
+            continue;
+          visited[idx] = q;
+          update( idx, static_cast<float>(hammingDistance(query, descriptors_.ptr<uint8_t>(idx), desc_bytes)) );
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "hamming_matcher.h"
+
+// Multi-probe locality sensitive hashing index of binary descriptors (e.g., ORB), used for approximate
+// nearest neighbors search under the Hamming distance. Each hash table uses as key a random subset of the
+// descriptor bits; at query time, also the buckets whose keys differ by up to probe_level bits from the
+// query key are probed, see:
+// Q. Lv et al., "Multi-Probe LSH: Efficient Indexing for High-Dimensional Similarity Search"
+class BinaryLshIndex
+{
+ public:
+
+  struct Params
+  {
+    // More tables and more probes increase the recall, more key bits increase the speed
+    int num_tables = 6;
+    int key_bits = 14;
+    // 0: only the query bucket, 1: also the buckets at 1 bit distance, 2: also at 2 bits distance
+    int probe_level = 1;
+    // Ratio test threshold between the distances of the best and second best neighbors (used by the matcher)
+    float max_ratio = 0.8f;
+  };
+
+  // Build the index for a set of CV_8U descriptors (one per row). The descriptors are not copied:
+  // the matrix should not be modified while the index is used
+  void build( const cv::Mat &descriptors, const Params &params );
+
+  // Approximate 2 nearest neighbors of each query descriptor: candidates taken from the probed buckets are
+  // ranked with the exact Hamming distance. Missing neighbors have index -1
+  void knn2( const cv::Mat &queries, std::vector<Knn2Match> &matches ) const;
+
+  bool empty() const { return tables_.empty(); };
+  void clear();
+
+ private:
+
+  struct HashTable
+  {
+    // Sampled bit positions
+    std::vector<int> bits;
+    // Descriptors keys in increasing order, and the corresponding descriptor indices
+    std::vector<uint32_t> keys;
+    std::vector<int> indices;
+  };
+
+  uint32_t hashKey( const HashTable &table, const uint8_t *desc ) const;
+
+  Params params_;
+  cv::Mat descriptors_;
+  std::vector<HashTable> tables_;
+};
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <opencv2/opencv.hpp>
@@ -6,19 +9,146 @@
 
 #include "features_matcher.h"
 
+// Check if arg is an option in the form --name=value, in case store the value
+static bool parseOption( const std::string &arg, const std::string &name, std::string &value )
+{
+  std::string prefix = "--" + name + "=";
+  if( arg.compare(0, prefix.size(), prefix) != 0 )
+    return false;
+  value = arg.substr(prefix.size());
+  return true;
+}
+
 int main(int argc, char **argv)
 {
   if( argc < 4 )
   {
     std::cout<<"Usage : "<<argv[0]<<" <calibration parameters filename> <images folder filename>"
-                          <<"<output data file> [focal length scale]"<<std::endl;
+                          <<"<output data file> [focal length scale] [options]"<<std::endl
+             <<"Options :"<<std::endl
+             <<"  --threads=<n>   number of worker threads (default: all the available cores)"<<std::endl
+             <<"  --undistort=<image|keypoints>   undistort whole images or just keypoints (default: image)"<<std::endl
+             <<"  --features=<orb|sift|akaze>   feature detector and descriptor (default: orb)"<<std::endl
+             <<"  --max-keypoints=<n>   keep at most n evenly distributed keypoints per image (default: 0, all)"<<std::endl
+             <<"  --keypoints-grid=<cols>x<rows> --max-keypoints-per-cell=<n>   grid and per cell caps of the keypoints selection"<<std::endl
+             <<"  --matching=<exhaustive|sequential|retrieval>   image pairs to be matched (default: exhaustive)"<<std::endl
+             <<"  --window=<n>   number of following images matched with each image in sequential mode (default: 10)"<<std::endl
+             <<"  --loop-stride=<n>   stride of the loop closure probing in sequential mode (default: 0, disabled)"<<std::endl
+             <<"  --retrieval-k=<n>   number of similar images matched with each image (default: 20)"<<std::endl
+             <<"  --descriptor-matching=<bruteforce|lsh>   exact or approximate (LSH) descriptors matching (default: bruteforce)"<<std::endl
+             <<"  --lsh-tables=<n> --lsh-key-bits=<n> --lsh-probe-level=<0|1|2> --lsh-ratio=<r>   LSH parameters"<<std::endl
+             <<"  --ratio=<r>   ratio test threshold of the brute force matches (default: 0.8, >= 1 to disable it)"<<std::endl
+             <<"  --cross-check=<0|1>   keep only the mutual nearest neighbors matches (default: 1)"<<std::endl
+             <<"  --min-matches=<n>   minimum number of filtered matches to verify an image pair (default: 15)"<<std::endl
+             <<"  --guided-matching=<0|1>   search further matches along the verified epipolar geometry (default: 0)"<<std::endl
+             <<"  --coarse-keypoints=<n>   first verify each pair with its n strongest keypoints only (default: 0, disabled)"<<std::endl
+             <<"  --coarse-min-inliers=<n>   inliers needed to pass the coarse verification (default: 10)"<<std::endl
+             <<"  --feature-cache=<dir>   directory of the persistent feature cache (default: disabled)"<<std::endl
+             <<"  --memory-budget=<MB>   bound the memory used by the descriptors while matching (default: 0, unbounded)"<<std::endl
+             <<"  --spill-dir=<dir>   directory of the descriptors spill file (default: system temporary directory)"<<std::endl
+             <<"  --vocabulary=<file>   vocabulary tree file, loaded if it exists, otherwise trained and saved"<<std::endl
+             <<"  --output-format=<text|binary>   format of the output data file (default: text)"<<std::endl
+             <<"  --export-matches=<dir>   write the matches images into this directory, without any display (default: disabled)"<<std::endl
+             <<"  --export-scale=<s> --export-max-pairs=<n>   scale of the exported images (default: 0.5) and maximum number of pairs (default: 0, all)"<<std::endl
+             <<"  --viewer=<0|1>   show the matches interactively at the end (default: 1, skipped without a display)"<<std::endl;
     return 0;
   }
   std::string results_file(argv[3]);
 
   double focal_scale = 1.0;
-  if( argc > 4 )
-    focal_scale = atof(argv[4]);
+  int num_threads = 0;
+  FeatureMatcher::UndistortionMode undistortion_mode = FeatureMatcher::UNDISTORT_IMAGE;
+  std::string matching_mode = "exhaustive", vocabulary_file, feature_cache_dir, spill_dir;
+  size_t memory_budget_mb = 0;
+  int retrieval_k = 20, window_size = 10, loop_stride = 0;
+  FeatureMatcher::DescriptorMatching descriptor_matching = FeatureMatcher::BRUTE_FORCE_MATCHING;
+  BinaryLshIndex::Params lsh_params;
+  FeatureMatcher::VerificationParams verification_params;
+  KeypointsSelectionParams keypoints_selection;
+  FeatureBackend::Type feature_backend = FeatureBackend::ORB_FEATURES;
+  bool binary_output = false, viewer = true;
+  std::string export_dir;
+  double export_scale = 0.5;
+  int export_max_pairs = 0;
+  for( int i = 4; i < argc; i++ )
+  {
+    std::string arg(argv[i]), value;
+    if( parseOption(arg, "threads", value) )
+      num_threads = atoi(value.c_str());
+    else if( parseOption(arg, "undistort", value) && (value == "image" || value == "keypoints") )
+      undistortion_mode = ( value == "image" ) ? FeatureMatcher::UNDISTORT_IMAGE : FeatureMatcher::UNDISTORT_KEYPOINTS;
+    else if( parseOption(arg, "features", value) && (value == "orb" || value == "sift" || value == "akaze") )
+      feature_backend = ( value == "orb" ) ? FeatureBackend::ORB_FEATURES :
+                        ( value == "sift" ) ? FeatureBackend::SIFT_FEATURES : FeatureBackend::AKAZE_FEATURES;
+    else if( parseOption(arg, "max-keypoints", value) )
+      keypoints_selection.max_keypoints = atoi(value.c_str());
+    else if( parseOption(arg, "keypoints-grid", value) )
+    {
+      if( sscanf(value.c_str(), "%dx%d", &keypoints_selection.grid_cols, &keypoints_selection.grid_rows) != 2 )
+      {
+        std::cerr<<"Invalid keypoints grid "<<value<<", exiting"<<std::endl;
+        return -1;
+      }
+    }
+    else if( parseOption(arg, "max-keypoints-per-cell", value) )
+      keypoints_selection.max_keypoints_per_cell = atoi(value.c_str());
+    else if( parseOption(arg, "matching", value) &&
+             (value == "exhaustive" || value == "sequential" || value == "retrieval") )
+      matching_mode = value;
+    else if( parseOption(arg, "window", value) )
+      window_size = atoi(value.c_str());
+    else if( parseOption(arg, "loop-stride", value) )
+      loop_stride = atoi(value.c_str());
+    else if( parseOption(arg, "retrieval-k", value) )
+      retrieval_k = atoi(value.c_str());
+    else if( parseOption(arg, "vocabulary", value) )
+      vocabulary_file = value;
+    else if( parseOption(arg, "descriptor-matching", value) && (value == "bruteforce" || value == "lsh") )
+      descriptor_matching = ( value == "lsh" ) ? FeatureMatcher::LSH_MATCHING : FeatureMatcher::BRUTE_FORCE_MATCHING;
+    else if( parseOption(arg, "lsh-tables", value) )
+      lsh_params.num_tables = atoi(value.c_str());
+    else if( parseOption(arg, "lsh-key-bits", value) )
+      lsh_params.key_bits = atoi(value.c_str());
+    else if( parseOption(arg, "lsh-probe-level", value) )
+      lsh_params.probe_level = atoi(value.c_str());
+    else if( parseOption(arg, "lsh-ratio", value) )
+      lsh_params.max_ratio = atof(value.c_str());
+    else if( parseOption(arg, "ratio", value) )
+      verification_params.max_ratio = atof(value.c_str());
+    else if( parseOption(arg, "cross-check", value) )
+      verification_params.cross_check = atoi(value.c_str()) != 0;
+    else if( parseOption(arg, "min-matches", value) )
+      verification_params.min_matches = atoi(value.c_str());
+    else if( parseOption(arg, "guided-matching", value) )
+      verification_params.guided_matching = atoi(value.c_str()) != 0;
+    else if( parseOption(arg, "coarse-keypoints", value) )
+      verification_params.coarse_keypoints = atoi(value.c_str());
+    else if( parseOption(arg, "coarse-min-inliers", value) )
+      verification_params.coarse_min_inliers = atoi(value.c_str());
+    else if( parseOption(arg, "feature-cache", value) )
+      feature_cache_dir = value;
+    else if( parseOption(arg, "memory-budget", value) )
+      memory_budget_mb = std::max( atoi(value.c_str()), 0 );
+    else if( parseOption(arg, "spill-dir", value) )
+      spill_dir = value;
+    else if( parseOption(arg, "output-format", value) && (value == "text" || value == "binary") )
+      binary_output = ( value == "binary" );
+    else if( parseOption(arg, "export-matches", value) )
+      export_dir = value;
+    else if( parseOption(arg, "export-scale", value) )
+      export_scale = atof(value.c_str());
+    else if( parseOption(arg, "export-max-pairs", value) )
+      export_max_pairs = atoi(value.c_str());
+    else if( parseOption(arg, "viewer", value) )
+      viewer = atoi(value.c_str()) != 0;
+    else if( arg.compare(0, 2, "--") != 0 )
+      focal_scale = atof(argv[i]);
+    else
+    {
+      std::cerr<<"Unknown option "<<arg<<", exiting"<<std::endl;
+      return -1;
+    }
+  }
 
   cv::Size image_size;
   cv::Mat intrinsics_matrix, dist_coeffs;
@@ -43,14 +173,52 @@ int main(int argc, char **argv)
 
   FeatureMatcher matcher(intrinsics_matrix, dist_coeffs, focal_scale );
   matcher.setImagesNames(images_names);
+  matcher.setNumThreads(num_threads);
+  if( !matcher.setFeatureBackend(feature_backend) )
+  {
+    std::cerr<<"Feature backend not available, exiting"<<std::endl;
+    return -1;
+  }
+  matcher.setUndistortionMode(undistortion_mode);
+  matcher.setKeypointsSelection(keypoints_selection);
+  matcher.setVocabulary(vocabulary_file);
+  matcher.setFeatureCache(feature_cache_dir);
+  matcher.setMemoryBudget(memory_budget_mb*1024*1024, spill_dir);
+  matcher.setDescriptorMatching(descriptor_matching, lsh_params);
+  matcher.setVerificationParams(verification_params);
   matcher.extractFeatures();
-  matcher.exhaustiveMatching();
-  std::cout<<"Exhaustive matching done!"<<std::endl;
-  matcher.writeToFile(results_file, true);
+  if( matching_mode == "sequential" )
+  {
+    matcher.sequentialMatching(window_size, loop_stride);
+    std::cout<<"Sequential matching done!"<<std::endl;
+  }
+  else if( matching_mode == "retrieval" )
+  {
+    matcher.retrievalMatching(retrieval_k);
+    std::cout<<"Retrieval matching done!"<<std::endl;
+  }
+  else
+  {
+    matcher.exhaustiveMatching();
+    std::cout<<"Exhaustive matching done!"<<std::endl;
+  }
+  matcher.writeToFile(results_file, true, binary_output);
   std::cout<<"Results saved to "<<results_file<<std::endl;
-  std::cout<<"Type any key to check matches, ESC to exit"<<std::endl;
 
-  matcher.testMatches();
+  if( !export_dir.empty() )
+    matcher.exportMatches(export_dir, export_scale, export_max_pairs);
+
+  // On headless machines, the viewer would wait forever
+  if( viewer && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY") )
+  {
+    std::cout<<"No display available, skipping the matches viewer"<<std::endl;
+    viewer = false;
+  }
+  if( viewer )
+  {
+    std::cout<<"Type any key to check matches, ESC to exit"<<std::endl;
+    matcher.testMatches();
+  }
 
   return 0;
 }
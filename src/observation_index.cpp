@@ -0,0 +1,155 @@
+#include "observation_index.h"
+#include "parallel_utils.h"
+
+#include <algorithm>
+#include <cstddef>
+
+namespace
+{
+  // Stable counting sort of the items by key: on output, the items with key k are
+  // [offsets[k], offsets[k + 1]) in sorted, in the same relative order they have in items
+  void countingSort( int num_keys, const std::vector<int> &keys, const std::vector<int> &items,
+                     std::vector<int> &offsets, std::vector<int> &sorted )
+  {
+    offsets.assign(num_keys + 1, 0);
+    for( int key : keys )
+      offsets[key + 1]++;
+    for( int k = 0; k < num_keys; k++ )
+      offsets[k + 1] += offsets[k];
+
+    std::vector<int> pos( offsets.begin(), offsets.end() - 1 );
+    sorted.resize(items.size());
+    for( size_t i = 0; i < items.size(); i++ )
+      sorted[pos[keys[i]]++] = items[i];
+  }
+} // namespace
+
+void ObservationIndex::build( int num_cams, int num_points, const std::vector<int> &cam_pose_index,
+                              const std::vector<int> &point_index )
+{
+  clear();
+  const int num_obs = static_cast<int>(point_index.size());
+
+  // Radix sort of the observations by (camera, point, observation) index: first by point, then (stably) by
+  // camera
+  std::vector<int> obs(num_obs), by_point, by_cam, offsets, keys(num_obs);
+  for( int i_obs = 0; i_obs < num_obs; i_obs++ )
+    obs[i_obs] = i_obs;
+  countingSort(num_points, point_index, obs, offsets, by_point);
+  for( int k = 0; k < num_obs; k++ )
+    keys[k] = cam_pose_index[by_point[k]];
+  countingSort(num_cams, keys, by_point, offsets, by_cam);
+
+  // Camera entries, keeping only the last observation of each (camera, point) pair
+  cam_offsets_.assign(num_cams + 1, 0);
+  cam_points_.reserve(num_obs);
+  cam_obs_.reserve(num_obs);
+  for( int i_cam = 0; i_cam < num_cams; i_cam++ )
+  {
+    for( int k = offsets[i_cam]; k < offsets[i_cam + 1]; k++ )
+    {
+      int i_obs = by_cam[k];
+      if( k + 1 < offsets[i_cam + 1] && point_index[by_cam[k + 1]] == point_index[i_obs] )
+        continue;
+      cam_points_.push_back(point_index[i_obs]);
+      cam_obs_.push_back(i_obs);
+    }
+    cam_offsets_[i_cam + 1] = static_cast<int>(cam_points_.size());
+  }
+
+  // Point entries: the camera entries are visited by increasing camera index, hence the cameras of each point
+  // are sorted as well
+  std::vector<int> cams(cam_points_.size());
+  for( int i_cam = 0; i_cam < num_cams; i_cam++ )
+    for( int k = cam_offsets_[i_cam]; k < cam_offsets_[i_cam + 1]; k++ )
+      cams[k] = i_cam;
+  countingSort(num_points, cam_points_, cams, point_offsets_, point_cams_);
+  countingSort(num_points, cam_points_, cam_obs_, point_offsets_, point_obs_);
+}
+
+int ObservationIndex::findObservation( int cam_idx, int pt_idx ) const
+{
+  // Branch-light binary search (the conditional is compiled into a conditional move)
+  Entries e = cameraEntries(cam_idx);
+  if( !e.size )
+    return -1;
+  const int *base = e.ids;
+  int n = e.size;
+  while( n > 1 )
+  {
+    int half = n/2;
+    base = ( base[half] <= pt_idx ) ? base + half : base;
+    n -= half;
+  }
+  return ( *base == pt_idx ) ? e.obs[base - e.ids] : -1;
+}
+
+int ObservationIndex::numShared( int cam0_idx, int cam1_idx ) const
+{
+  int num_shared = 0;
+  forEachShared( cam0_idx, cam1_idx, [&num_shared]( int, int, int ){ num_shared++; } );
+  return num_shared;
+}
+
+void ObservationIndex::coVisibility( std::vector<CoVisibility> &pairs, int num_threads ) const
+{
+  pairs.clear();
+  const int num_cams = numCameras();
+  if( !num_cams )
+    return;
+
+  // The pairs of each camera with the cameras of higher index, computed in blocks of consecutive cameras
+  std::vector< std::vector<CoVisibility> > cam_pairs(num_cams);
+  WorkStealingPool pool(num_threads);
+  const int block_size = std::max( 1, num_cams/(4*pool.numThreads()) );
+  for( int block_start = 0; block_start < num_cams; block_start += block_size )
+  {
+    pool.submit([&, block_start]()
+    {
+      // Shared points counters, reset through the list of the touched cameras
+      std::vector<int> counters(num_cams, 0), touched;
+      for( int i_cam = block_start; i_cam < std::min(block_start + block_size, num_cams); i_cam++ )
+      {
+        Entries cam_entries = cameraEntries(i_cam);
+        for( int k = 0; k < cam_entries.size; k++ )
+        {
+          // The cameras of each point are sorted: only the ones after i_cam are counted
+          Entries pt_entries = pointEntries(cam_entries.ids[k]);
+          for( const int *c = std::upper_bound(pt_entries.ids, pt_entries.ids + pt_entries.size, i_cam);
+               c != pt_entries.ids + pt_entries.size; c++ )
+          {
+            if( !counters[*c]++ )
+              touched.push_back(*c);
+          }
+        }
+
+        std::sort(touched.begin(), touched.end());
+        cam_pairs[i_cam].reserve(touched.size());
+        for( int c : touched )
+        {
+          cam_pairs[i_cam].push_back( { i_cam, c, counters[c] } );
+          counters[c] = 0;
+        }
+        touched.clear();
+      }
+    });
+  }
+  pool.wait();
+
+  size_t num_pairs = 0;
+  for( auto &p : cam_pairs )
+    num_pairs += p.size();
+  pairs.reserve(num_pairs);
+  for( auto &p : cam_pairs )
+    pairs.insert(pairs.end(), p.begin(), p.end());
+}
+
+void ObservationIndex::clear()
+{
+  std::vector<int>().swap(cam_offsets_);
+  std::vector<int>().swap(cam_points_);
+  std::vector<int>().swap(cam_obs_);
+  std::vector<int>().swap(point_offsets_);
+  std::vector<int>().swap(point_cams_);
+  std::vector<int>().swap(point_obs_);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+
+// Index of the observations of a SfM problem in both directions, camera -> (point, observation) and
+// point -> (camera, observation), stored in compressed form: the entries of the c-th camera are
+// [cam_offsets_[c], cam_offsets_[c + 1]) in cam_points_ and cam_obs_, sorted by point index, and similarly
+// the entries of each point are sorted by camera index. If a camera observes a same point more than once,
+// only its last observation is indexed
+class ObservationIndex
+{
+ public:
+
+  // Entries of a camera (point indices) or of a point (camera indices), along with their observation indices
+  struct Entries
+  {
+    const int *ids, *obs;
+    int size;
+  };
+
+  // Pair of camera poses that observe some common points
+  struct CoVisibility
+  {
+    int cam0_idx, cam1_idx;
+    int num_shared;
+  };
+
+  // Build the index given, for each observation, the index of its camera and of its point
+  void build( int num_cams, int num_points, const std::vector<int> &cam_pose_index,
+              const std::vector<int> &point_index );
+
+  int numCameras() const { return cam_offsets_.empty() ? 0 : static_cast<int>(cam_offsets_.size()) - 1; };
+  int numPoints() const { return point_offsets_.empty() ? 0 : static_cast<int>(point_offsets_.size()) - 1; };
+
+  // Points observed by the cam_idx-th camera, sorted by index
+  Entries cameraEntries( int cam_idx ) const
+  {
+    int begin = cam_offsets_[cam_idx];
+    return { cam_points_.data() + begin, cam_obs_.data() + begin, cam_offsets_[cam_idx + 1] - begin };
+  };
+
+  // Cameras that observe the pt_idx-th point, sorted by index
+  Entries pointEntries( int pt_idx ) const
+  {
+    int begin = point_offsets_[pt_idx];
+    return { point_cams_.data() + begin, point_obs_.data() + begin, point_offsets_[pt_idx + 1] - begin };
+  };
+
+  // Index of the observation of the pt_idx-th point from the cam_idx-th camera, -1 if the camera does not
+  // observe the point
+  int findObservation( int cam_idx, int pt_idx ) const;
+
+  // Call f( pt_idx, obs0_idx, obs1_idx ) for each point observed by both cameras, by increasing point index
+  template <typename F> void forEachShared( int cam0_idx, int cam1_idx, F f ) const
+  {
+    Entries e0 = cameraEntries(cam0_idx), e1 = cameraEntries(cam1_idx);
+    int k0 = 0, k1 = 0;
+    while( k0 < e0.size && k1 < e1.size )
+    {
+      int pt0 = e0.ids[k0], pt1 = e1.ids[k1];
+      if( pt0 == pt1 )
+        f( pt0, e0.obs[k0], e1.obs[k1] );
+      k0 += ( pt0 <= pt1 );
+      k1 += ( pt1 <= pt0 );
+    }
+  };
+
+  // Number of points observed by both cameras
+  int numShared( int cam0_idx, int cam1_idx ) const;
+
+  // Compute the co-visibility graph, i.e., all the pairs of cameras with at least one shared point
+  // (cam0_idx < cam1_idx), sorted by camera indices. Each point is visited once per camera that observes it,
+  // and the cameras are processed in parallel (num_threads <= 0 means all the available cores)
+  void coVisibility( std::vector<CoVisibility> &pairs, int num_threads = 0 ) const;
+
+  void clear();
+
+ private:
+
+  std::vector<int> cam_offsets_, cam_points_, cam_obs_;
+  std::vector<int> point_offsets_, point_cams_, point_obs_;
+};
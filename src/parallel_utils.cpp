@@ -0,0 +1,123 @@
+#include "parallel_utils.h"
+
+namespace
+{
+  // Pool and worker index of the current thread, if it is a pool worker
+  thread_local const WorkStealingPool *current_pool = nullptr;
+  thread_local int current_worker = -1;
+} // namespace
+
+WorkStealingPool::WorkStealingPool( int num_threads )
+{
+  num_threads = resolveNumThreads(num_threads);
+  for( int i = 0; i < num_threads; i++ )
+    queues_.emplace_back(new WorkerQueue);
+  for( int i = 0; i < num_threads; i++ )
+    threads_.emplace_back( &WorkStealingPool::run, this, i );
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this]{ return num_pending_ == 0; });
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for( auto &t : threads_ )
+    t.join();
+}
+
+void WorkStealingPool::submit( std::function<void()> task )
+{
+  size_t queue_idx = ( current_pool == this ) ? current_worker : next_queue_++ % queues_.size();
+  {
+    std::lock_guard<std::mutex> lock(queues_[queue_idx]->mutex);
+    queues_[queue_idx]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_queued_++;
+    num_pending_++;
+  }
+  work_cv_.notify_one();
+}
+
+void WorkStealingPool::wait()
+{
+  std::exception_ptr error;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this]{ return num_pending_ == 0; });
+    std::swap(error, error_);
+  }
+  if( error )
+    std::rethrow_exception(error);
+}
+
+bool WorkStealingPool::popTask( int worker_idx, std::function<void()> &task )
+{
+  // First look in the own queue (LIFO, the most recent task is likely to be still in cache)...
+  {
+    auto &q = *queues_[worker_idx];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if( !q.tasks.empty() )
+    {
+      task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      return true;
+    }
+  }
+  // ... then steal the oldest task from the other workers
+  int num_queues = static_cast<int>(queues_.size());
+  for( int i = 1; i < num_queues; i++ )
+  {
+    auto &q = *queues_[(worker_idx + i) % num_queues];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if( !q.tasks.empty() )
+    {
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::run( int worker_idx )
+{
+  current_pool = this;
+  current_worker = worker_idx;
+
+  while( true )
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this]{ return stop_ || num_queued_ > 0; });
+      if( num_queued_ == 0 )
+        return;
+      // Reserve a task: it is already inside one of the queues
+      num_queued_--;
+    }
+
+    std::function<void()> task;
+    while( !popTask(worker_idx, task) )
+      std::this_thread::yield();
+
+    std::exception_ptr error;
+    try
+    {
+      task();
+    }
+    catch( ... )
+    {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if( error && !error_ )
+      error_ = error;
+    if( --num_pending_ == 0 )
+      done_cv_.notify_all();
+  }
+}
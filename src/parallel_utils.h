@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Return the number of worker threads to be used given the requested one: a value <= 0 means
+// "use all the available cores"
+inline int resolveNumThreads( int num_threads )
+{
+  if( num_threads > 0 )
+    return num_threads;
+  return std::max( 1, static_cast<int>(std::thread::hardware_concurrency()) );
+}
+
+// Fixed capacity, multi-producer multi-consumer FIFO queue used to connect the stages of a pipeline.
+// push() blocks while the queue is full, pop() blocks while the queue is empty. Once close() has been
+// called, push() fails and pop() returns false as soon as the queue has been drained
+template <typename T> class BoundedQueue
+{
+ public:
+
+  explicit BoundedQueue( size_t capacity ) : capacity_( std::max<size_t>(capacity, 1) ) {};
+
+  bool push( T item )
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]{ return closed_ || items_.size() < capacity_; });
+    if( closed_ )
+      return false;
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  bool pop( T &item )
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]{ return closed_ || !items_.empty(); });
+    if( items_.empty() )
+      return false;
+    item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed: wake up all the waiting consumers
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+
+  size_t capacity_;
+  bool closed_ = false;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_, not_full_;
+};
+
+// Thread pool for tasks with very different costs. Each worker owns a deque of tasks: it pops tasks from the
+// back of its own deque and, once it is empty, it steals tasks from the front of the other workers' deques.
+// Tasks submitted from outside the pool are spread round-robin among the deques, tasks submitted from a task
+// go to the deque of the worker that is running it
+class WorkStealingPool
+{
+ public:
+
+  // Start the workers (num_threads <= 0 means all the available cores)
+  explicit WorkStealingPool( int num_threads = 0 );
+
+  // Wait for the pending tasks, then stop the workers
+  ~WorkStealingPool();
+
+  WorkStealingPool( const WorkStealingPool & ) = delete;
+  WorkStealingPool &operator=( const WorkStealingPool & ) = delete;
+
+  void submit( std::function<void()> task );
+
+  // Wait until all the submitted tasks have been executed. If a task threw an exception, the first one
+  // is re-thrown here. Do not call it from inside a task
+  void wait();
+
+  int numThreads() const { return static_cast<int>(threads_.size()); };
+
+ private:
+
+  struct WorkerQueue
+  {
+    std::mutex mutex;
+    std::deque< std::function<void()> > tasks;
+  };
+
+  void run( int worker_idx );
+  bool popTask( int worker_idx, std::function<void()> &task );
+
+  std::vector< std::unique_ptr<WorkerQueue> > queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_queue_{0};
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_, done_cv_;
+  // Tasks waiting inside the queues, and tasks submitted but not yet completed
+  size_t num_queued_ = 0, num_pending_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+};
@@ -1,19 +1,58 @@
+#include <cstdlib>
 #include <iostream>
 #include <string>
 #include <opencv2/opencv.hpp>
 
 #include "basic_sfm.h"
 
+// Check if arg is an option in the form --name=value, in case store the value
+static bool parseOption( const std::string &arg, const std::string &name, std::string &value )
+{
+  std::string prefix = "--" + name + "=";
+  if( arg.compare(0, prefix.size(), prefix) != 0 )
+    return false;
+  value = arg.substr(prefix.size());
+  return true;
+}
+
 int main(int argc, char **argv)
 {
   if( argc < 3 )
   {
-    std::cout<<"Usage : "<<argv[0]<<" <input data file> <output ply file>"<<std::endl;
+    std::cout<<"Usage : "<<argv[0]<<" <input data file> <output ply file> [options]"<<std::endl
+             <<"Options :"<<std::endl
+             <<"  --threads=<n>   number of worker threads (default: all the available cores)"<<std::endl
+             <<"  --seed-candidates=<k>   number of seed pairs evaluated concurrently (default: 1)"<<std::endl
+             <<"  --local-ba=<n>   local bundle adjustment with the n most co-visible poses (default: 0, always global)"<<std::endl
+             <<"  --global-ba-growth=<percent>   model growth that triggers a global bundle adjustment (default: 10)"<<std::endl;
     return 0;
   }
   std::string input_file(argv[1]);
 
+  int num_threads = 0, num_seed_candidates = 1, local_ba_neighbors = 0;
+  double global_ba_growth = 10.0;
+  for( int i = 3; i < argc; i++ )
+  {
+    std::string arg(argv[i]), value;
+    if( parseOption(arg, "threads", value) )
+      num_threads = atoi(value.c_str());
+    else if( parseOption(arg, "seed-candidates", value) )
+      num_seed_candidates = atoi(value.c_str());
+    else if( parseOption(arg, "local-ba", value) )
+      local_ba_neighbors = atoi(value.c_str());
+    else if( parseOption(arg, "global-ba-growth", value) )
+      global_ba_growth = atof(value.c_str());
+    else
+    {
+      std::cerr<<"Unknown option "<<arg<<", exiting"<<std::endl;
+      return -1;
+    }
+  }
+
   BasicSfM sfm;
+  sfm.setNumThreads(num_threads);
+  sfm.setNumSeedCandidates(num_seed_candidates);
+  sfm.setLocalBundleAdjustment(local_ba_neighbors, global_ba_growth/100.0);
   sfm.readFromFile(input_file, false, true );
   sfm.solve();
   sfm.writeToPLYFile(argv[2]);
@@ -0,0 +1,136 @@
+#include "track_builder.h"
+
+#include <numeric>
+
+void TrackBuilder::init( const std::vector<int> &num_features )
+{
+  clear();
+  nodes_offsets_.resize(num_features.size() + 1);
+  nodes_offsets_[0] = 0;
+  for( size_t i = 0; i < num_features.size(); i++ )
+    nodes_offsets_[i + 1] = nodes_offsets_[i] + static_cast<uint32_t>(num_features[i]);
+  nodes_matched_.assign(nodes_offsets_.back(), 0);
+}
+
+void TrackBuilder::addMatches( int img0_idx, int img1_idx, const std::vector<cv::DMatch> &matches )
+{
+  uint32_t offset0 = nodes_offsets_[img0_idx], offset1 = nodes_offsets_[img1_idx];
+  matches_nodes_.reserve(matches_nodes_.size() + 2*matches.size());
+  for( auto &match : matches )
+  {
+    matches_nodes_.push_back(offset0 + match.queryIdx);
+    matches_nodes_.push_back(offset1 + match.trainIdx);
+    nodes_matched_[offset0 + match.queryIdx] = nodes_matched_[offset1 + match.trainIdx] = 1;
+  }
+}
+
+void TrackBuilder::matchedFeatures( int img_idx, std::vector<char> &matched ) const
+{
+  matched.assign( nodes_matched_.begin() + nodes_offsets_[img_idx],
+                  nodes_matched_.begin() + nodes_offsets_[img_idx + 1] );
+}
+
+void TrackBuilder::build( Tracks &tracks ) const
+{
+  tracks = Tracks();
+  const int num_images = numImages();
+  const uint32_t num_nodes = num_images ? nodes_offsets_.back() : 0;
+
+  // Union-find where the root of each set is always its smallest node: every node has a parent smaller
+  // than (or equal to) itself, and the sets roots do not depend on the order of the unions
+  std::vector<uint32_t> parent(num_nodes);
+  std::iota(parent.begin(), parent.end(), 0);
+  auto find = [&parent]( uint32_t n )
+  {
+    while( parent[n] != n )
+    {
+      // Path halving
+      parent[n] = parent[parent[n]];
+      n = parent[n];
+    }
+    return n;
+  };
+
+  // Track of each node, -2 for the nodes without matches
+  std::vector<int> node_track(num_nodes, -2);
+  for( size_t k = 0; k < matches_nodes_.size(); k += 2 )
+  {
+    uint32_t n0 = matches_nodes_[k], n1 = matches_nodes_[k + 1];
+    node_track[n0] = node_track[n1] = -1;
+    uint32_t r0 = find(n0), r1 = find(n1);
+    if( r0 < r1 )
+      parent[r1] = r0;
+    else if( r1 < r0 )
+      parent[r0] = r1;
+  }
+
+  // Label the tracks in a single pass over the nodes in increasing order: the parent of each node has
+  // already been visited (hence it points directly to its root), new tracks start at their root
+  int num_tracks = 0;
+  for( uint32_t n = 0; n < num_nodes; n++ )
+  {
+    if( node_track[n] == -2 )
+      continue;
+    parent[n] = parent[parent[n]];
+    node_track[n] = ( parent[n] == n ) ? num_tracks++ : node_track[parent[n]];
+  }
+  std::vector<uint32_t>().swap(parent);
+
+  // Count the features of each track, and look for tracks with more than one feature from a same image
+  // (the nodes of each track are visited by increasing image index)
+  std::vector<int> track_size(num_tracks, 0), track_last_image(num_tracks, -1);
+  std::vector<char> track_valid(num_tracks, 1);
+  for( int i = 0; i < num_images; i++ )
+  {
+    for( uint32_t n = nodes_offsets_[i]; n < nodes_offsets_[i + 1]; n++ )
+    {
+      int t = node_track[n];
+      if( t < 0 )
+        continue;
+      if( track_last_image[t] == i )
+        track_valid[t] = 0;
+      track_last_image[t] = i;
+      track_size[t]++;
+    }
+  }
+
+  // Final track ids (only valid tracks) and offsets
+  std::vector<int> track_id(num_tracks, -1);
+  tracks.offsets.reserve(num_tracks + 1);
+  tracks.offsets.push_back(0);
+  for( int t = 0; t < num_tracks; t++ )
+  {
+    if( !track_valid[t] )
+    {
+      tracks.num_rejected++;
+      continue;
+    }
+    track_id[t] = tracks.numTracks();
+    tracks.offsets.push_back(tracks.offsets.back() + track_size[t]);
+  }
+
+  // Fill the tracks features, by increasing image index
+  int num_features = tracks.offsets.back();
+  tracks.images_idx.resize(num_features);
+  tracks.features_idx.resize(num_features);
+  std::vector<int> track_pos(tracks.offsets.begin(), tracks.offsets.end() - 1);
+  for( int i = 0; i < num_images; i++ )
+  {
+    for( uint32_t n = nodes_offsets_[i]; n < nodes_offsets_[i + 1]; n++ )
+    {
+      int t = node_track[n];
+      if( t < 0 || track_id[t] < 0 )
+        continue;
+      int pos = track_pos[track_id[t]]++;
+      tracks.images_idx[pos] = i;
+      tracks.features_idx[pos] = static_cast<int>(n - nodes_offsets_[i]);
+    }
+  }
+}
+
+void TrackBuilder::clear()
+{
+  nodes_offsets_.clear();
+  std::vector<uint32_t>().swap(matches_nodes_);
+  std::vector<char>().swap(nodes_matched_);
+}
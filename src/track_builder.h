@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Feature tracks: each track is a set of features from different images, all matched (directly or
+// transitively) with each other, i.e., the observations of a same 3D point. Tracks are stored in compressed
+// form: the features of the t-th track are [offsets[t], offsets[t + 1]) in images_idx and features_idx,
+// sorted by image index
+struct Tracks
+{
+  std::vector<int> offsets;
+  std::vector<int> images_idx, features_idx;
+  // Number of tracks discarded since they include more than one feature from a same image
+  int num_rejected = 0;
+
+  int numTracks() const { return offsets.empty() ? 0 : static_cast<int>(offsets.size()) - 1; };
+};
+
+// Build the feature tracks from the pairwise matches between images. Matches are just collected in a flat
+// array, tracks are then computed at once with a union-find over all the (image, feature) nodes: the result
+// does not depend on the order in which the matches are added
+class TrackBuilder
+{
+ public:
+
+  // Set the number of features of each image, and remove all the matches
+  void init( const std::vector<int> &num_features );
+
+  int numImages() const { return nodes_offsets_.empty() ? 0 : static_cast<int>(nodes_offsets_.size()) - 1; };
+  size_t numMatches() const { return matches_nodes_.size()/2; };
+
+  // Add the matches between the img0_idx-th image (queryIdx) and the img1_idx-th image (trainIdx)
+  void addMatches( int img0_idx, int img1_idx, const std::vector<cv::DMatch> &matches );
+
+  // Set matched[f] to 1 for the features of the img_idx-th image with at least one match, to 0 for the others
+  void matchedFeatures( int img_idx, std::vector<char> &matched ) const;
+
+  // Compute the tracks of all the matches added so far, tracks that include two features from a same image
+  // (i.e., inconsistent matches) are discarded. Tracks are sorted by their first (image, feature) node
+  void build( Tracks &tracks ) const;
+
+  void clear();
+
+ private:
+
+  // First node of each image (nodes are the features of all the images, numbered consecutively)
+  std::vector<uint32_t> nodes_offsets_;
+  // Pairs of matched nodes
+  std::vector<uint32_t> matches_nodes_;
+  // 1 for the nodes with at least one match
+  std::vector<char> nodes_matched_;
+};
@@ -0,0 +1,394 @@
+#include "vocabulary_tree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+#include "hamming_matcher.h"
+
+namespace
+{
+  const char vocabulary_magic[4] = { 'V', 'O', 'C', 'T' };
+  const int32_t vocabulary_version = 1;
+  const int max_clustering_iterations = 8;
+
+  int nearestCenter( const uint8_t *desc, const std::vector<const uint8_t *> &centers, int desc_bytes )
+  {
+    int best_idx = 0, best_dist = hammingDistance(desc, centers[0], desc_bytes);
+    for( int c = 1; c < static_cast<int>(centers.size()); c++ )
+    {
+      int dist = hammingDistance(desc, centers[c], desc_bytes);
+      if( dist < best_dist )
+      {
+        best_dist = dist;
+        best_idx = c;
+      }
+    }
+    return best_idx;
+  }
+
+  // Bitwise majority (i.e., the Hamming distance median) of a set of binary descriptors
+  void majorityCenter( const std::vector<const uint8_t *> &descs, int desc_bytes, uint8_t *center )
+  {
+    std::vector<int> bit_counts(desc_bytes*8, 0);
+    for( auto desc : descs )
+    {
+      for( int i = 0; i < desc_bytes; i++ )
+      {
+        for( int b = 0; b < 8; b++ )
+          bit_counts[i*8 + b] += (desc[i] >> b) & 1;
+      }
+    }
+    for( int i = 0; i < desc_bytes; i++ )
+    {
+      center[i] = 0;
+      for( int b = 0; b < 8; b++ )
+      {
+        if( 2*bit_counts[i*8 + b] > static_cast<int>(descs.size()) )
+          center[i] |= 1 << b;
+      }
+    }
+  }
+} // namespace
+
+void VocabularyTree::train( const std::vector<cv::Mat> &images_descriptors, int branching, int depth,
+                            int max_train_descriptors )
+{
+  nodes_.clear();
+  centers_.clear();
+  words_weights_.clear();
+  branching_ = std::max( branching, 2 );
+  depth_ = std::max( depth, 1 );
+  desc_bytes_ = 0;
+
+  size_t num_descriptors = 0;
+  for( auto &d : images_descriptors )
+  {
+    num_descriptors += d.rows;
+    if( !d.empty() )
+      desc_bytes_ = d.cols;
+  }
+  if( !num_descriptors )
+    return;
+
+  // Evenly sample the training descriptors from all the images
+  int stride = static_cast<int>( std::max<size_t>( 1, (num_descriptors + max_train_descriptors - 1)/max_train_descriptors ) );
+  std::vector<const uint8_t *> train_descs;
+  std::vector<int> image_first_desc;
+  for( auto &d : images_descriptors )
+  {
+    image_first_desc.push_back(train_descs.size());
+    for( int r = 0; r < d.rows; r += stride )
+      train_descs.push_back(d.ptr<uint8_t>(r));
+  }
+  image_first_desc.push_back(train_descs.size());
+
+  std::cout<<"Training a "<<branching_<<"^"<<depth_<<" vocabulary tree with "<<train_descs.size()
+           <<" descriptors"<<std::endl;
+
+  nodes_.emplace_back();
+  centers_.resize(desc_bytes_, 0);
+  buildNode( 0, train_descs, 0 );
+
+  int num_words = 0;
+  for( auto &node : nodes_ )
+  {
+    if( !node.num_children )
+      node.word_id = num_words++;
+  }
+
+  // Inverse document frequency of each word, computed over the training images
+  int num_images = static_cast<int>(images_descriptors.size());
+  std::vector<int> words_images(num_words, 0), last_image(num_words, -1);
+  for( int i = 0; i < num_images; i++ )
+  {
+    for( int k = image_first_desc[i]; k < image_first_desc[i + 1]; k++ )
+    {
+      int w = wordId(train_descs[k]);
+      if( last_image[w] != i )
+      {
+        last_image[w] = i;
+        words_images[w]++;
+      }
+    }
+  }
+  words_weights_.resize(num_words);
+  for( int w = 0; w < num_words; w++ )
+    words_weights_[w] = std::log( static_cast<float>(num_images)/std::max(words_images[w], 1) );
+
+  std::cout<<"Vocabulary tree with "<<num_words<<" words built"<<std::endl;
+}
+
+void VocabularyTree::buildNode( int node_idx, const std::vector<const uint8_t *> &descs, int level )
+{
+  if( level >= depth_ || descs.size() <= 1 )
+    return;
+
+  std::vector< std::vector<const uint8_t *> > clusters;
+  std::vector<uint8_t> clusters_centers;
+
+  if( static_cast<int>(descs.size()) <= branching_ )
+  {
+    // Not enough descriptors: each one is a cluster
+    for( auto desc : descs )
+    {
+      clusters.emplace_back(1, desc);
+      clusters_centers.insert(clusters_centers.end(), desc, desc + desc_bytes_);
+    }
+  }
+  else
+  {
+    // k-means++ seeding, with a deterministic random generator
+    std::mt19937 rng(node_idx);
+    std::vector<const uint8_t *> seeds(1, descs[rng() % descs.size()]);
+    std::vector<double> min_dists(descs.size());
+    for( size_t k = 0; k < descs.size(); k++ )
+      min_dists[k] = hammingDistance(descs[k], seeds[0], desc_bytes_);
+    while( static_cast<int>(seeds.size()) < branching_ )
+    {
+      std::vector<double> weights(descs.size());
+      for( size_t k = 0; k < descs.size(); k++ )
+        weights[k] = min_dists[k]*min_dists[k];
+      double sum = 0;
+      for( auto w : weights ) sum += w;
+      // All the remaining descriptors are equal to some seed
+      if( sum <= 0 )
+        break;
+      std::discrete_distribution<size_t> sampler(weights.begin(), weights.end());
+      seeds.push_back(descs[sampler(rng)]);
+      for( size_t k = 0; k < descs.size(); k++ )
+        min_dists[k] = std::min<double>( min_dists[k], hammingDistance(descs[k], seeds.back(), desc_bytes_) );
+    }
+
+    int num_clusters = static_cast<int>(seeds.size());
+    clusters_centers.resize(num_clusters*desc_bytes_);
+    for( int c = 0; c < num_clusters; c++ )
+      std::memcpy( clusters_centers.data() + c*desc_bytes_, seeds[c], desc_bytes_ );
+
+    // k-medians iterations
+    std::vector<int> assignment(descs.size(), -1);
+    std::vector<const uint8_t *> centers(num_clusters);
+    for( int it = 0; it < max_clustering_iterations; it++ )
+    {
+      for( int c = 0; c < num_clusters; c++ )
+        centers[c] = clusters_centers.data() + c*desc_bytes_;
+
+      bool changed = false;
+      clusters.assign(num_clusters, std::vector<const uint8_t *>());
+      for( size_t k = 0; k < descs.size(); k++ )
+      {
+        int c = nearestCenter(descs[k], centers, desc_bytes_);
+        changed = changed || c != assignment[k];
+        assignment[k] = c;
+        clusters[c].push_back(descs[k]);
+      }
+      if( !changed )
+        break;
+
+      for( int c = 0; c < num_clusters; c++ )
+      {
+        if( !clusters[c].empty() )
+          majorityCenter( clusters[c], desc_bytes_, clusters_centers.data() + c*desc_bytes_ );
+      }
+    }
+  }
+
+  // Add the (non empty) clusters as children of the node, then split them
+  int first_child = static_cast<int>(nodes_.size()), num_children = 0;
+  std::vector<int> children_clusters;
+  for( int c = 0; c < static_cast<int>(clusters.size()); c++ )
+  {
+    if( clusters[c].empty() )
+      continue;
+    nodes_.emplace_back();
+    centers_.insert(centers_.end(), clusters_centers.data() + c*desc_bytes_,
+                    clusters_centers.data() + (c + 1)*desc_bytes_);
+    children_clusters.push_back(c);
+    num_children++;
+  }
+  nodes_[node_idx].first_child = first_child;
+  nodes_[node_idx].num_children = num_children;
+
+  for( int k = 0; k < num_children; k++ )
+    buildNode( first_child + k, clusters[children_clusters[k]], level + 1 );
+}
+
+int VocabularyTree::wordId( const uint8_t *desc ) const
+{
+  int node_idx = 0;
+  while( nodes_[node_idx].num_children )
+  {
+    const Node &node = nodes_[node_idx];
+    int best_child = node.first_child, best_dist = hammingDistance(desc, center(best_child), desc_bytes_);
+    for( int c = node.first_child + 1; c < node.first_child + node.num_children; c++ )
+    {
+      int dist = hammingDistance(desc, center(c), desc_bytes_);
+      if( dist < best_dist )
+      {
+        best_dist = dist;
+        best_child = c;
+      }
+    }
+    node_idx = best_child;
+  }
+  return nodes_[node_idx].word_id;
+}
+
+void VocabularyTree::transform( const cv::Mat &descriptors, BowVector &bow ) const
+{
+  bow.clear();
+  if( empty() || descriptors.empty() )
+    return;
+
+  std::vector<int> words(descriptors.rows);
+  for( int r = 0; r < descriptors.rows; r++ )
+    words[r] = wordId(descriptors.ptr<uint8_t>(r));
+  std::sort(words.begin(), words.end());
+
+  // TF-IDF weights (the term frequency normalization is absorbed by the final L1 normalization)
+  double sum = 0;
+  for( size_t k = 0; k < words.size(); )
+  {
+    size_t k1 = k;
+    while( k1 < words.size() && words[k1] == words[k] )
+      k1++;
+    float weight = (k1 - k)*words_weights_[words[k]];
+    if( weight > 0 )
+    {
+      bow.emplace_back(words[k], weight);
+      sum += weight;
+    }
+    k = k1;
+  }
+
+  for( auto &w : bow )
+    w.second = static_cast<float>(w.second/sum);
+}
+
+bool VocabularyTree::save( const std::string &filename ) const
+{
+  FILE* fptr = fopen(filename.c_str(), "wb");
+
+  if (fptr == NULL) {
+    std::cerr << "Error: unable to open file " << filename << std::endl;
+    return false;
+  };
+
+  int32_t header[6] = { vocabulary_version, branching_, depth_, desc_bytes_,
+                        static_cast<int32_t>(nodes_.size()), numWords() };
+  bool ok = fwrite(vocabulary_magic, 1, 4, fptr) == 4 && fwrite(header, sizeof(int32_t), 6, fptr) == 6;
+  for( size_t i = 0; ok && i < nodes_.size(); i++ )
+  {
+    int32_t node[3] = { nodes_[i].first_child, nodes_[i].num_children, nodes_[i].word_id };
+    ok = fwrite(node, sizeof(int32_t), 3, fptr) == 3;
+  }
+  ok = ok && fwrite(centers_.data(), 1, centers_.size(), fptr) == centers_.size();
+  ok = ok && fwrite(words_weights_.data(), sizeof(float), words_weights_.size(), fptr) == words_weights_.size();
+
+  fclose(fptr);
+  return ok;
+}
+
+bool VocabularyTree::load( const std::string &filename )
+{
+  FILE* fptr = fopen(filename.c_str(), "rb");
+
+  if (fptr == NULL) {
+    std::cerr << "Error: unable to open file " << filename << std::endl;
+    return false;
+  };
+
+  char magic[4];
+  int32_t header[6];
+  bool ok = fread(magic, 1, 4, fptr) == 4 && std::memcmp(magic, vocabulary_magic, 4) == 0 &&
+            fread(header, sizeof(int32_t), 6, fptr) == 6 && header[0] == vocabulary_version &&
+            header[1] >= 2 && header[2] >= 1 && header[3] > 0 && header[4] > 0 && header[5] > 0;
+  if( ok )
+  {
+    branching_ = header[1];
+    depth_ = header[2];
+    desc_bytes_ = header[3];
+    nodes_.resize(header[4]);
+    centers_.resize(static_cast<size_t>(header[4])*desc_bytes_);
+    words_weights_.resize(header[5]);
+  }
+  for( size_t i = 0; ok && i < nodes_.size(); i++ )
+  {
+    int32_t node[3];
+    ok = fread(node, sizeof(int32_t), 3, fptr) == 3;
+    nodes_[i].first_child = node[0];
+    nodes_[i].num_children = node[1];
+    nodes_[i].word_id = node[2];
+  }
+  ok = ok && fread(centers_.data(), 1, centers_.size(), fptr) == centers_.size();
+  ok = ok && fread(words_weights_.data(), sizeof(float), words_weights_.size(), fptr) == words_weights_.size();
+
+  fclose(fptr);
+
+  // The children of each node must follow it in nodes_ (hence wordId() always reaches a leaf), and each
+  // leaf must refer to a valid word
+  for( size_t i = 0; ok && i < nodes_.size(); i++ )
+  {
+    const Node &node = nodes_[i];
+    if( node.num_children )
+      ok = node.num_children > 0 && node.num_children <= branching_ &&
+           node.first_child > static_cast<int>(i) &&
+           static_cast<size_t>(node.first_child) + node.num_children <= nodes_.size();
+    else
+      ok = node.word_id >= 0 && node.word_id < numWords();
+  }
+
+  if( !ok )
+  {
+    std::cerr << "Error: invalid vocabulary file " << filename << std::endl;
+    nodes_.clear();
+    centers_.clear();
+    words_weights_.clear();
+  }
+  return ok;
+}
+
+int ImageDatabase::add( const BowVector &bow )
+{
+  int image_id = num_images_++;
+  for( auto &w : bow )
+    inverted_file_[w.first].emplace_back(image_id, w.second);
+  return image_id;
+}
+
+void ImageDatabase::query( const BowVector &bow, int max_results, std::vector< std::pair<int, float> > &results,
+                           int exclude_id ) const
+{
+  results.clear();
+
+  // L1 score: 1 - |v - w|/2 = sum over the common words of (|v_i| + |w_i| - |v_i - w_i|)/2
+  std::vector<float> scores(num_images_, 0.0f);
+  for( auto &w : bow )
+  {
+    for( auto &entry : inverted_file_[w.first] )
+      scores[entry.first] += w.second + entry.second - std::fabs(w.second - entry.second);
+  }
+
+  for( int i = 0; i < num_images_; i++ )
+  {
+    if( i != exclude_id && scores[i] > 0 )
+      results.emplace_back(i, 0.5f*scores[i]);
+  }
+
+  auto by_score = []( const std::pair<int, float> &a, const std::pair<int, float> &b )
+  {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  };
+  if( static_cast<int>(results.size()) > max_results )
+  {
+    std::partial_sort(results.begin(), results.begin() + max_results, results.end(), by_score);
+    results.resize(max_results);
+  }
+  else
+  {
+    std::sort(results.begin(), results.end(), by_score);
+  }
+}
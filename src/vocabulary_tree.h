@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Sparse bag of words vector: pairs [word id, weight] sorted by word id, L1 normalized
+typedef std::vector< std::pair<int, float> > BowVector;
+
+// Hierarchical vocabulary of binary descriptors (e.g., ORB), built by recursive k-medians clustering
+// under the Hamming distance with TF-IDF weighting of the words, see:
+// D. Galvez-Lopez and J. D. Tardos, "Bags of Binary Words for Fast Place Recognition in Image Sequences"
+class VocabularyTree
+{
+ public:
+
+  // Build the vocabulary from the CV_8U descriptors of a set of images (one descriptor per row), with the
+  // given branching factor and depth (i.e., up to branching^depth words). At most max_train_descriptors
+  // descriptors, evenly sampled among all the images, are used for the clustering
+  void train( const std::vector<cv::Mat> &images_descriptors, int branching = 10, int depth = 4,
+              int max_train_descriptors = 500000 );
+
+  // Save / load the vocabulary to / from a binary file, return false on failure
+  bool save( const std::string &filename ) const;
+  bool load( const std::string &filename );
+
+  bool empty() const { return nodes_.empty(); };
+  int numWords() const { return static_cast<int>(words_weights_.size()); };
+  int descriptorBytes() const { return desc_bytes_; };
+
+  // Get the id of the word (leaf of the tree) that is the closest to a descriptor
+  int wordId( const uint8_t *desc ) const;
+
+  // Compute the L1 normalized TF-IDF bag of words vector of a set of descriptors
+  void transform( const cv::Mat &descriptors, BowVector &bow ) const;
+
+ private:
+
+  // Tree node: the children of a node are stored contiguously in nodes_, their cluster centers in centers_
+  struct Node
+  {
+    int first_child = -1, num_children = 0, word_id = -1;
+  };
+
+  // Recursively cluster the descriptors that fall into the node_idx-th node
+  void buildNode( int node_idx, const std::vector<const uint8_t *> &descs, int level );
+
+  const uint8_t *center( int node_idx ) const { return centers_.data() + static_cast<size_t>(node_idx)*desc_bytes_; };
+
+  int branching_ = 0, depth_ = 0, desc_bytes_ = 0;
+  std::vector<Node> nodes_;
+  std::vector<uint8_t> centers_;
+  // Inverse document frequency of each word
+  std::vector<float> words_weights_;
+};
+
+// Inverted file over the bag of words vectors of a set of images, used to retrieve the images most
+// similar to a query image
+class ImageDatabase
+{
+ public:
+
+  explicit ImageDatabase( int num_words ) : inverted_file_(num_words) {};
+
+  // Add an image to the database, return its id (ids are assigned incrementally, starting from 0)
+  int add( const BowVector &bow );
+
+  // Retrieve the (up to) max_results images most similar to the query bag of words vector, as pairs
+  // [image id, score] sorted by decreasing score (L1 score, in [0,1]). The image with id exclude_id is skipped
+  void query( const BowVector &bow, int max_results, std::vector< std::pair<int, float> > &results,
+              int exclude_id = -1 ) const;
+
+ private:
+
+  // For each word, the pairs [image id, weight] of the images where the word appears
+  std::vector< std::vector< std::pair<int, float> > > inverted_file_;
+  int num_images_ = 0;
+};